@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+
+// per-worker arena over 2 MB regions, backed by transparent huge pages where available
+// built with -DJPEG_ARENA (make run ARENA=1) the global operator new/delete are replaced and,
+// while an ArenaScope is active, every operator new of the thread is served from the arena,
+// without it a scope changes nothing and the host allocator (malloc, jemalloc, ASan) is kept
+// freed blocks are recycled by size class and reset drops everything in O(1)
+// regions of a destroyed arena go back to a shared free list for the next one
+// nothing allocated inside a scope may be used after the next reset, so function-local
+// statics have to be touched before the first scope (warm_encoder_tables)
+class Arena {
+public:
+    static const size_t region_size = 2 << 20;
+    static const int class_num = 13;    // 16 B to 64 KB, larger blocks are recycled best fit
+
+    Arena();
+    ~Arena();
+
+    void *allocate(size_t bytes);
+    void release(void *pointer);
+    void reset();
+
+    size_t get_used();          // live bytes
+    size_t get_high_water();    // peak of live bytes since construction
+
+private:
+    struct Region {
+        char *begin;
+        char *end;
+    };
+
+    Region *regions = nullptr;      // kept across resets, malloc'd so it never recurses
+    int region_num = 0;
+    int region_capacity = 0;
+    int current = -1;
+    char *top = nullptr;
+    size_t used = 0;
+    size_t high_water = 0;
+    void *free_list[class_num] = {};
+    void *large_list = nullptr;
+
+    char *bump(size_t bytes);
+};
+
+// address space shared by every arena, reserved once by the first call or the first Arena,
+// a smaller budget keeps ulimit -v happy, arenas past it fall back to malloc
+const size_t default_arena_space = 4ULL << 30;
+void reserve_arena_space(size_t bytes);
+
+bool is_arena_pointer(void *pointer);
+Arena *set_current_arena(Arena *arena);
+
+struct ArenaScope {
+    Arena *previous;
+
+    ArenaScope(Arena &arena) : previous(set_current_arena(&arena)) {}
+    ~ArenaScope() { set_current_arena(previous); }
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <future>
+#include <string>
+
+#include "pipeline.hpp"
+
+// asynchronous encode on the library's worker pool, one arena per worker
+// progress is reported per MCU row, cancellation and the deadline are checked between
+// stages and MCU rows, a stopped encode resolves to false and writes nothing
+// image, file and control have to outlive the future
+std::future<bool> encode_jpeg_async(PPM &image, std::ostream &file, PipelineEncoder encode, EncodeControl &control);
+std::future<bool> convert_jpeg_async(std::string in_filename, std::string out_filename, PipelineEncoder encode, EncodeControl &control);
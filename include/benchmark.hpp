@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "jpeg.hpp"
+
+// quality metrics, over the area of the decoded image
+double get_PSNR(std::vector<std::vector<RGB>> &origin, std::vector<std::vector<RGB>> &decoded);
+double get_SSIM(std::vector<std::vector<RGB>> &origin, std::vector<std::vector<RGB>> &decoded);
+
+// speed/quality regression harness
+struct BenchmarkMode {
+    std::string name;
+    std::function<bool(std::string &, std::string &)> convert;    // in, out filename
+    double min_PSNR;
+    double min_SSIM;
+};
+
+struct BenchmarkThreshold {
+    double PSNR_offset;           // added to min_PSNR of every mode
+    double min_SSIM;              // overrides min_SSIM of a mode if higher
+    double max_ms_per_megapixel;  // encode time limit, <= 0 disables it
+};
+
+struct BenchmarkResult {
+    std::string image;
+    std::string mode;
+    long long size;
+    double encode_ms;
+    double PSNR;
+    double SSIM;
+    bool pass;
+};
+
+std::vector<BenchmarkMode> get_benchmark_modes();
+BenchmarkResult run_benchmark_case(std::string &in_filename, std::string &out_filename, BenchmarkMode &mode, BenchmarkThreshold &threshold);
+int run_benchmark(std::string &in_folder, std::string &out_folder, BenchmarkThreshold &threshold);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <streambuf>
+
+#include "jpeg.hpp"
+
+// streams over recycled buffers
+struct MemoryInBuffer : std::streambuf {
+    MemoryInBuffer(char *data, long long size);
+};
+
+struct VectorOutBuffer : std::streambuf {
+    std::vector<char> &data;
+
+    VectorOutBuffer(std::vector<char> &data);
+
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+};
+
+// socket io, the read buffer is kept across connections
+struct SocketReader {
+    int fd;
+    std::vector<char> &buffer;
+    int begin = 0;
+    int end = 0;
+
+    SocketReader(int fd, std::vector<char> &buffer);
+
+    bool fill();
+    bool read_line(std::string &line);
+    bool read_bytes(std::vector<char> &data, long long size);
+};
+
+bool write_socket(int fd, const char *data, long long size);
+
+// encode request, one line followed by the inline bytes if any
+//   <mode> <scale> path <in_filename> [out_filename]
+//   <mode> <scale> inline <n_bytes>
+//   shutdown                     only if the daemon allows it
+// reply
+//   OK path <out_filename>       written to out_filename
+//   OK <n_bytes>                 followed by the JPEG bytes
+//   ERR <message>
+// mode is normal, DHT, DQT, sampled_DHT, sampled_DQT, RDO or RDO_fast,
+// scale is the DQT scale or the RDO lambda, ignored by the other modes
+struct DaemonRequest {
+    std::string mode;
+    float scale;
+    std::string source;         // path, inline or shutdown
+    std::string in_filename;
+    std::string out_filename;   // empty to reply with the bytes
+    long long size;             // inline bytes
+};
+
+struct DaemonSetting {
+    int n_worker;               // warm encoding threads
+    int queue_depth;            // accepted connections waiting for a worker
+    long long max_image_size;   // pixel bytes of one image, larger headers are rejected
+    bool allow_shutdown;        // any client that can connect may stop the daemon
+};
+
+bool parse_daemon_request(std::string &line, DaemonRequest &request);
+bool encode_by_mode(std::string &mode, float scale, PPM &image, std::ostream &file);
+int run_daemon(std::string &socket_path, DaemonSetting &setting);
+
+// client
+bool send_daemon_request(std::string &socket_path, std::string &line, std::vector<char> &payload, std::string &reply, std::vector<char> &data);
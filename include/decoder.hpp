@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+#include "jpeg.hpp"
+
+// JPEG (baseline, huffman coded)
+struct JPEGComponent {
+    int id;
+    int h;              // horizontal sampling factor
+    int v;              // vertical sampling factor
+    int quan_id;
+    int dc_id;
+    int ac_id;
+    int block_rows;     // padded to whole MCUs
+    int block_cols;
+    std::vector<std::vector<int>> blocks;   // quantized coefficients in zigzag order
+};
+
+struct JPEG {
+    int height;
+    int width;
+    int max_h;
+    int max_v;
+    int mcu_rows;
+    int mcu_cols;
+    int restart_interval;
+    std::vector<std::vector<int>> quan_tables;      // natural order
+    std::vector<std::vector<int>> huffman_dc;       // same format as huffman_lum_dc
+    std::vector<std::vector<int>> huffman_ac;
+    std::vector<JPEGComponent> components;
+    std::vector<std::vector<unsigned char>> app_segments;   // APPn, COM kept as is
+};
+
+// bit reader
+struct BitReader {
+    std::vector<unsigned char> &data;
+    int pos;
+    int bit_buffer = 0;
+    int bit_count = 0;
+
+    BitReader(std::vector<unsigned char> &data, int pos);
+
+    int get_bit();
+    int get_bits(int length);
+    int read_restart_marker();
+};
+
+// huffman decoding
+struct HuffmanDecoder {
+    int max_code[18];
+    int val_offset[18];
+    std::vector<int> symbols;
+};
+
+HuffmanDecoder preprocess_huffman_decoder(const std::vector<int> &table);
+int decode_huffman(HuffmanDecoder &decoder, BitReader &reader);
+int extend_VLI(int value, int len);
+
+// parse
+int read_JPEG_scan(std::vector<unsigned char> &data, int pos, JPEG &jpeg);
+// max_size bounds the coefficients (64 per block) the frame header may claim
+bool load_JPEG(std::string &filename, JPEG &jpeg, long long max_size = PPM_max_size);
+
+// re-encode coefficients
+void write_JPEG_SOF0_section(std::ostream &file, JPEG &jpeg);
+void write_JPEG_SOS_section(std::ostream &file, JPEG &jpeg);
+void write_JPEG_data_section(std::ostream &file, JPEG &jpeg, int get_statistics, std::vector<void *> &huffman_ac, std::vector<void *> &huffman_dc);
+void optimize_JPEG_huffman(JPEG &jpeg);
+void write_JPEG(std::ostream &file, JPEG &jpeg);
+void write_JPEG(std::string &filename, JPEG &jpeg);
+
+// pixel reconstruction
+// colors are converted back with the inverse of the RGB_to_YCbCr matrix
+std::vector<double> get_IDCT_table(int block);
+void inverse_2d_DCT(std::vector<double> &block_data, int block, const std::vector<double> &cos_table);
+std::vector<std::vector<double>> decode_JPEG_component(JPEG &jpeg, JPEGComponent &comp);
+int clamp_pixel(double value);
+std::vector<std::vector<RGB>> decode_JPEG_pixels(JPEG &jpeg);
+
+// convert
+bool convert_optimized_jpeg(std::string &in_filename, std::string &out_filename);
@@ -18,4 +18,5 @@ public:
 
 void get_tree_info(Node *node, int depth, std::map<int, std::vector<int>> &info);
 void cleanup(Node *node);
+void limit_code_length(std::vector<int> &bits, int max_length);
 std::vector<int> huffman_encode(std::vector<int> &freq);
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <fstream>
+
+#include "jpeg.hpp"
+
+// incremental re-encode
+// the previous frame is kept as pixels, quantized blocks and one entropy coded
+// segment per restart interval, an update only redoes the blocks and intervals it touches
+struct IncrementalJPEG {
+    int height;                 // cropped to whole blocks
+    int width;
+    int n_channel;
+    int restart_interval;       // blocks per restart interval
+    int adjusted_DHT;           // tables built from the first frame
+    std::vector<unsigned char> pixels;                  // previous frame, PPM layout
+    std::vector<std::vector<dYCbCr>> YCbCr_data;
+    std::vector<std::vector<iYCbCr>> blocks_data;       // zigzag order
+    std::vector<int> huffman_tables[4];                 // lum ac, lum dc, chrom ac, chrom dc
+    std::map<int, HuffmanInfo> huffman_info[4];
+    std::vector<unsigned char> header;                  // SOI to SOS
+    std::vector<std::vector<unsigned char>> segments;   // padded and byte stuffed, without RSTn
+};
+
+// pixel rectangle, clipped to the image
+struct DirtyRect {
+    int row;
+    int col;
+    int height;
+    int width;
+};
+
+void update_YCbCr_block(IncrementalJPEG &state, PPM &image, int row, int col);
+std::vector<unsigned char> encode_restart_interval(IncrementalJPEG &state, int interval);
+
+// restart_interval <= 0 takes one block row, adjusted_DHT builds the tables from the first frame
+void init_incremental_jpeg(IncrementalJPEG &state, PPM &image, int restart_interval = 0, int adjusted_DHT = 0);
+// rects nullptr compares every block with the previous frame, returns the re-encoded interval count
+int update_incremental_jpeg(IncrementalJPEG &state, PPM &image, std::vector<DirtyRect> *rects = nullptr);
+void write_incremental_jpeg(std::ostream &file, IncrementalJPEG &state);
@@ -3,7 +3,11 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <cstdint>
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <functional>
 
 // PPM
 struct PPM {
@@ -11,6 +15,7 @@ struct PPM {
     int width;
     int height;
     int max_value;
+    int channel;    // 1 for P5 (PGM), 3 for P6
     unsigned char *data;
 };
 
@@ -20,7 +25,13 @@ struct RGB {
     int b;
 };
 
-void remove_PPM_comment(std::ifstream &file);
+// P5 and P6 with max_value up to 255 only, anything else or more than max_size pixel bytes
+// loads with data == nullptr before any allocation
+const long long PPM_max_size = 1LL << 30;
+
+void remove_PPM_comment(std::istream &file);
+bool read_PPM_header(std::istream &file, PPM &image, long long max_size = PPM_max_size);
+PPM load_PPM(std::istream &file, long long max_size = PPM_max_size);
 PPM load_PPM(std::string &filename);
 std::vector<std::vector<RGB>> PPM_data_to_vector(PPM &image);
 
@@ -35,7 +46,10 @@ struct YCbCr {
 typedef YCbCr<int> iYCbCr;
 typedef YCbCr<double> dYCbCr;
 
+dYCbCr pixel_to_YCbCr(RGB &pixel);
 std::vector<std::vector<dYCbCr>> RGB_to_YCbCr(std::vector<std::vector<RGB>> &RGB_data);
+std::vector<std::vector<dYCbCr>> gray_to_YCbCr(PPM &image);
+std::vector<std::vector<dYCbCr>> image_to_YCbCr(PPM &image);
 
 // JPEG constant
 // Quantization table
@@ -48,15 +62,55 @@ extern std::vector<int> huffman_lum_dc;
 extern std::vector<int> huffman_chrom_ac;
 extern std::vector<int> huffman_chrom_dc;
 
+// cancellation and progress of one encode, the async runner makes it current for its thread
+struct EncodeControl {
+    std::atomic<bool> cancelled{false};
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    std::function<void(int, int)> progress;    // MCU rows done, MCU rows in the pass
+};
+
+EncodeControl *get_encode_control();
+EncodeControl *set_encode_control(EncodeControl *control);
+bool is_encode_cancelled(EncodeControl *control);
+
 // process image with JPEG standard
+struct RDOSetting;
+
 int around(double value);
-std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block);
+std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel = 3);
 std::vector<int> get_adjusted_quantize_table(std::vector<std::vector<int>> &data, float scale, int use_lum);
 std::vector<iYCbCr> quantize(std::vector<iYCbCr> block_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom);
 std::vector<std::vector<int>> get_zigzag_order(int block);
 std::vector<iYCbCr> zigzag(std::vector<iYCbCr> block_data);
-std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> get_statistics_before_quantize(std::vector<std::vector<dYCbCr>> &YCbCr_data);
-std::vector<std::vector<iYCbCr>> do_partition_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom);
+std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> get_statistics_before_quantize(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> *sample_blocks = nullptr, int n_channel = 3);
+std::vector<iYCbCr> do_quantize_process(std::vector<iYCbCr> &block_DCT_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, int n_channel = 3, RDOSetting *rdo = nullptr);
+std::vector<iYCbCr> do_block_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, int n_channel = 3, RDOSetting *rdo = nullptr, std::vector<iYCbCr> *DCT_data = nullptr);
+
+// uniform and duplicate blocks, do_partition_process transforms constant blocks in closed form
+// and reuses the coefficients of a block whose pixels match an earlier one
+struct BlockCacheStats {
+    long long block_num;
+    long long uniform_num;
+    long long duplicate_num;
+};
+
+bool is_uniform_block(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel = 3);
+std::vector<iYCbCr> get_uniform_DCT(dYCbCr &pixel, int block, int n_channel = 3);
+unsigned long long get_block_hash(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel = 3);
+bool is_same_block(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int other_row, int other_col, int block, int n_channel = 3);
+BlockCacheStats get_block_cache_stats();    // totals since the start of the process
+
+std::vector<std::vector<iYCbCr>> do_partition_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, int n_channel = 3, RDOSetting *rdo = nullptr, std::vector<std::vector<iYCbCr>> *DCT_blocks = nullptr, EncodeControl *control = nullptr);
+
+// sampled statistics
+struct SampleSetting {
+    int row_step;     // take every row_step-th MCU row
+    int random_num;   // plus random blocks over the whole image
+    unsigned int seed;
+};
+
+std::vector<int> get_sample_blocks(int block_rows, int block_cols, SampleSetting &setting);
+void add_fallback_frequency(std::vector<int> &freq, int is_ac);
 
 // bit vector
 struct BitVector {
@@ -65,8 +119,9 @@ struct BitVector {
 
     void add_bit(unsigned char b);
     void add_bits(int value, int length);
+    void add_bit_vector(BitVector &other);
     void print_binary();
-    void write_binary(std::ofstream &file);
+    void write_binary(std::ostream &file);
 };
 
 // encoding to binary format
@@ -78,22 +133,79 @@ struct HuffmanInfo {
 int get_VLI(int value);
 void to_binary_str(int code, int n_bits, BitVector &in);
 std::map<int, HuffmanInfo> preprocess_DHT(const std::vector<int> &table);
+const HuffmanInfo &get_huffman_info(const std::map<int, HuffmanInfo> &table, int symbol);
+std::map<int, HuffmanInfo> *get_standard_DHT_info(const std::vector<int> &table);
+void warm_encoder_tables();
+
+// rate-distortion optimized quantization
+// coefficients are kept, reduced or zeroed to minimize distortion + lambda * bits
+struct RDOSetting {
+    double lambda;    // squared error worth one bit
+    int fast;         // only look back 4 nonzero candidates, never reduce
+    std::map<int, HuffmanInfo> *huffman_lum_ac;
+    std::map<int, HuffmanInfo> *huffman_chrom_ac;
+};
 
-void write_SOI_section(std::ofstream &file);
-void write_SOF0_section(std::ofstream &file, int height, int width);
-void write_DQT_section(std::ofstream &file, int num, const std::vector<int> &table);
-void write_huffman_section(std::ofstream &file, int num, const std::vector<int> &table);
-void write_SOS_section(std::ofstream &file);
+int get_RDO_code_bits(const std::map<int, HuffmanInfo> &table, int symbol);
+int get_RDO_bits(const std::map<int, HuffmanInfo> &table, int run, int len);
+int get_RDO_tail_bits(const std::map<int, HuffmanInfo> &table, int tail);
+void quantize_RDO_channel(std::vector<double> &coef, std::vector<int> &quan, std::vector<int> &out, std::map<int, HuffmanInfo> &table, RDOSetting &setting);
+std::vector<iYCbCr> quantize_RDO(std::vector<iYCbCr> block_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, RDOSetting &setting, int n_channel = 3);
+
+void write_SOI_section(std::ostream &file);
+void write_SOF0_section(std::ostream &file, int height, int width, int n_channel = 3);
+void write_DQT_section(std::ostream &file, int num, const std::vector<int> &table);
+void write_huffman_section(std::ostream &file, int num, const std::vector<int> &table);
+void write_SOS_section(std::ostream &file, int n_channel = 3);
+void write_DRI_section(std::ostream &file, int restart_interval);
+uint64_t get_nonzero_mask(const std::vector<int> &block);
+void encode_block(
+    std::vector<int> &block, int dc_value,
+    int get_statistics,
+    void *huffman_ac,
+    void *huffman_dc,
+    BitVector &bit_data
+);
+void encode_block_range(
+    std::vector<std::vector<iYCbCr>> &blocks_data, int begin, int end,
+    int get_statistics,
+    void *huffman_lum_ac,
+    void *huffman_lum_dc,
+    void *huffman_chrom_ac,
+    void *huffman_chrom_dc,
+    std::vector<int> *sample_blocks,
+    int n_channel,
+    BitVector &bit_data
+);
+// entropy coding threads for the calling thread's encodes, 0 picks from the core count,
+// pool, pipeline and daemon workers set 1 since they already run one encode per core,
+// slice threads never enter the caller's arena scope
+int set_entropy_thread_num(int n_thread);
+int get_entropy_thread_num(int block_num);
 void write_data_section(
-    std::ofstream &file, std::vector<std::vector<iYCbCr>> &blocks_data,
+    std::ostream &file, std::vector<std::vector<iYCbCr>> &blocks_data,
     int get_statistics,
     void *huffman_lum_ac,
     void *huffman_lum_dc,
     void *huffman_chrom_ac,
-    void *huffman_chrom_dc
+    void *huffman_chrom_dc,
+    std::vector<int> *sample_blocks = nullptr,
+    int n_channel = 3,
+    int n_thread = 1
 );
-void write_EOI_section(std::ofstream &file);
+void write_EOI_section(std::ostream &file);
 
+void write_jpeg(
+    std::ostream &file, int height, int width, std::vector<std::vector<iYCbCr>> &blocks_data,
+    std::vector<int> &quan_lum,
+    std::vector<int> &quan_chrom,
+    std::vector<int> &huffman_lum_ac,
+    std::vector<int> &huffman_lum_dc,
+    std::vector<int> &huffman_chrom_ac,
+    std::vector<int> &huffman_chrom_dc,
+    int n_channel = 3,
+    int n_thread = 0
+);
 void write_jpeg(
     std::string &filename, int height, int width, std::vector<std::vector<iYCbCr>> &blocks_data,
     std::vector<int> &quan_lum,
@@ -101,10 +213,25 @@ void write_jpeg(
     std::vector<int> &huffman_lum_ac,
     std::vector<int> &huffman_lum_dc,
     std::vector<int> &huffman_chrom_ac,
-    std::vector<int> &huffman_chrom_dc
+    std::vector<int> &huffman_chrom_dc,
+    int n_channel = 3,
+    int n_thread = 0
 );
 
+// encode an image already in memory
+// false and nothing written for an image that failed to load or a cancelled encode
+bool encode_normal_jpeg(PPM &image, std::ostream &file);
+bool encode_adjusted_DHT_jpeg(PPM &image, std::ostream &file);
+bool encode_adjusted_DQT_jpeg(PPM &image, std::ostream &file, float scale);
+bool encode_sampled_DHT_jpeg(PPM &image, std::ostream &file, SampleSetting &setting);
+bool encode_sampled_DQT_jpeg(PPM &image, std::ostream &file, float scale, SampleSetting &setting);
+bool encode_RDO_jpeg(PPM &image, std::ostream &file, double lambda, int fast);
+
 // convert
-void convert_normal_jpeg(std::string &in_filename, std::string &out_filename);
-void convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filename);
-void convert_adjusted_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale);
\ No newline at end of file
+// false and no output file if the input does not load
+bool convert_normal_jpeg(std::string &in_filename, std::string &out_filename);
+bool convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filename);
+bool convert_adjusted_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale);
+bool convert_sampled_DHT_jpeg(std::string &in_filename, std::string &out_filename, SampleSetting &setting);
+bool convert_sampled_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale, SampleSetting &setting);
+bool convert_RDO_jpeg(std::string &in_filename, std::string &out_filename, double lambda, int fast);
\ No newline at end of file
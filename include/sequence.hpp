@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <fstream>
+
+#include "jpeg.hpp"
+
+// Motion-JPEG sequence
+const int SEQUENCE_AVI = 0;
+const int SEQUENCE_MULTIPART = 1;
+
+struct SequenceSetting {
+    int format;             // SEQUENCE_AVI or SEQUENCE_MULTIPART
+    int fps;
+    int refresh_interval;   // rebuild the tables every N frames, <= 0 disables it
+    double refresh_gain;    // or once new tables would save this fraction of the data, <= 0 disables it
+    SampleSetting sample;   // blocks of every frame counted into the running histograms
+};
+
+struct SequenceEncoder {
+    std::ostream *file;
+    SequenceSetting setting;
+    int height;             // geometry of the first frame, cropped to whole blocks
+    int width;
+    int n_channel;
+    int frame_num;
+    int refresh_num;
+    int frames_since_refresh;
+    std::vector<int> sample_blocks;
+    std::vector<int> histograms[4];                     // lum ac, lum dc, chrom ac, chrom dc
+    std::vector<int> huffman_tables[4];
+    std::map<int, HuffmanInfo> huffman_info[4];
+    std::vector<unsigned char> header;                  // SOI to SOS, rebuilt on refresh
+    std::vector<std::pair<long long, long long>> index; // AVI chunk offset in movi, size
+    long long riff_pos;
+    long long movi_pos;
+};
+
+long long get_histogram_bits(std::vector<int> &histogram, const std::map<int, HuffmanInfo> &info, int is_ac);
+void set_sequence_tables(SequenceEncoder &encoder, std::vector<int> *huffman_tables);
+double get_sequence_gain(SequenceEncoder &encoder, std::vector<int> *huffman_tables);
+
+void write_le16(std::ostream &file, int value);
+void write_le32(std::ostream &file, long long value);
+void write_fourcc(std::ostream &file, const char *fourcc);
+void write_AVI_header(SequenceEncoder &encoder);
+
+void open_sequence(SequenceEncoder &encoder, std::ostream &file, SequenceSetting &setting);
+// false if the frame does not match the geometry of the first one
+bool add_sequence_frame(SequenceEncoder &encoder, PPM &image);
+void close_sequence(SequenceEncoder &encoder);
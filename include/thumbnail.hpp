@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+#include "jpeg.hpp"
+
+// DCT-domain thumbnails
+// a 1/scale image keeps the top-left 8/scale x 8/scale coefficients of every block and
+// inverts them with a reduced IDCT, scale 8 is the DC-only image
+std::vector<std::vector<double>> get_reduced_IDCT_table(int size);
+std::vector<std::vector<dYCbCr>> get_DCT_thumbnail(std::vector<std::vector<iYCbCr>> &DCT_blocks, int block_rows, int block_cols, int scale);
+
+// scales are 2, 4 or 8, a thumbnail smaller than one block leaves its file empty
+bool encode_thumbnail_jpeg(PPM &image, std::ostream &file, std::vector<int> &scales, std::vector<std::ostream *> &thumbnail_files);
+bool convert_thumbnail_jpeg(std::string &in_filename, std::string &out_filename, std::vector<int> &scales, std::vector<std::string> &thumbnail_filenames);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+
+// timeline trace, zones are compiled in only with -DJPEG_TRACE (make run TRACE=1)
+#ifdef JPEG_TRACE
+
+#include <atomic>
+
+struct TraceEvent {
+    const char *name;
+    long long begin;    // ns since the first event
+    long long end;
+    int arg;            // tile or slice index, -1 if none
+};
+
+// ring of the latest events of one thread, only that thread writes it
+// a thread that exits hands its buffer to the next new thread, which keeps the thread_id
+struct TraceBuffer {
+    static const int capacity = 1 << 16;
+
+    int thread_id;
+    std::atomic<long long> claimed{0};  // events written or being written
+    std::atomic<long long> count{0};    // events committed
+    TraceEvent events[capacity];
+};
+
+long long get_trace_time();
+TraceBuffer &get_trace_buffer();
+void record_trace_event(const char *name, long long begin, long long end, int arg);
+
+struct TraceZone {
+    const char *name;
+    int arg;
+    long long begin;
+
+    TraceZone(const char *name, int arg = -1) : name(name), arg(arg), begin(get_trace_time()) {}
+    ~TraceZone() { record_trace_event(name, begin, get_trace_time(), arg); }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_ZONE_ARG(name, arg) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name, arg)
+
+#else
+
+#define TRACE_ZONE(name)
+#define TRACE_ZONE_ARG(name, arg)
+
+#endif
+
+// Chrome/Perfetto trace JSON of every buffered zone, false if tracing is compiled out
+bool dump_trace(std::string &filename);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+#include "jpeg.hpp"
+#include "decoder.hpp"
+
+// YCbCr input that skips the RGB round trip, samples are taken as full-range JFIF YCbCr
+const int YUV_I420 = 0;    // Y plane, Cb plane, Cr plane, chroma at half width and height
+const int YUV_NV12 = 1;    // Y plane, interleaved CbCr plane at half width and height
+const int YUV_YUYV = 2;    // packed Y0 Cb Y1 Cr, chroma at half width
+
+// planes are read in place, strides in bytes
+// I420 uses planes 0 to 2, NV12 planes 0 and 1, YUYV plane 0
+struct YUVImage {
+    int format;
+    int width;
+    int height;
+    unsigned char *planes[3];
+    int strides[3];
+};
+
+// one component as seen by the DCT, step is the byte distance of neighbouring samples,
+// blocks past width x height repeat the last sample of the row and column
+struct YUVPlane {
+    unsigned char *data;
+    int stride;
+    int step;
+    int width;
+    int height;
+};
+
+std::vector<YUVPlane> get_YUV_planes(YUVImage &image);
+void init_YUV_JPEG(JPEG &jpeg, YUVImage &image);
+void do_plane_DCT(YUVPlane &plane, int row, int col, std::vector<double> &cos_table, std::vector<int> &block_data);
+
+// 4:2:0 or 4:2:2 SOF0 straight from the planes, the last MCU row and column are padded
+// with edge samples, false for an empty image
+bool encode_YUV_jpeg(YUVImage &image, std::ostream &file, int adjusted_DHT = 0);
+
+// raw frame file with tightly packed planes, data owns the bytes the image points into
+bool load_YUV(std::string &filename, int format, int width, int height, YUVImage &image, std::vector<unsigned char> &data);
+bool convert_YUV_jpeg(std::string &in_filename, std::string &out_filename, int format, int width, int height, int adjusted_DHT = 0);
@@ -0,0 +1,320 @@
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "arena.hpp"
+
+// one address range for every arena, so a pointer is identified by its address alone
+// regions are carved from it, a destroyed arena drops their pages and returns them
+std::once_flag reserve_once;
+std::atomic<char *> reserve_begin(nullptr);
+std::atomic<char *> reserve_end(nullptr);
+std::atomic<char *> reserve_top(nullptr);
+
+// returned regions, malloc'd so it never recurses
+struct RegionSpan {
+    char *begin;
+    char *end;
+};
+
+std::mutex region_mutex;
+RegionSpan *free_regions = nullptr;
+int free_region_num = 0;
+int free_region_capacity = 0;
+
+thread_local Arena *current_arena = nullptr;
+
+struct ArenaHeader {
+    Arena *owner;
+    size_t size;    // bytes after the header
+};
+
+void reserve_address_range(size_t bytes) {
+    // PROT_NONE and MAP_NORESERVE, nothing is committed until a region is taken
+    size_t align = Arena::region_size;
+    bytes = (bytes + align - 1) / align * align;
+    void *pointer = mmap(nullptr, bytes + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pointer == MAP_FAILED) {
+        return;
+    }
+
+    char *begin = (char *)(((uintptr_t)pointer + align - 1) & ~(uintptr_t)(align - 1));
+    reserve_top = begin;
+    reserve_end = begin + bytes;
+    reserve_begin = begin;
+}
+
+void reserve_arena_space(size_t bytes) {
+    // nothing is reserved when no operator new can reach an arena
+#ifdef JPEG_ARENA
+    std::call_once(reserve_once, [bytes] { reserve_address_range(bytes); });
+#else
+    (void)bytes;
+#endif
+}
+
+char *reuse_region(size_t bytes) {
+    // smallest returned span that fits, the rest of it stays free
+    std::lock_guard<std::mutex> lock(region_mutex);
+    int best = -1;
+    for (int i = 0; i < free_region_num; i++) {
+        size_t size = free_regions[i].end - free_regions[i].begin;
+        if (size >= bytes && (best < 0 || size < (size_t)(free_regions[best].end - free_regions[best].begin))) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return nullptr;
+    }
+
+    char *begin = free_regions[best].begin;
+    free_regions[best].begin += bytes;
+    if (free_regions[best].begin == free_regions[best].end) {
+        free_regions[best] = free_regions[--free_region_num];
+    }
+    return begin;
+}
+
+void return_region(char *begin, char *end) {
+    // the pages are dropped, the range stays mapped read write for the next arena
+    madvise(begin, end - begin, MADV_DONTNEED);
+
+    std::lock_guard<std::mutex> lock(region_mutex);
+    if (free_region_num == free_region_capacity) {
+        int capacity = free_region_capacity ? free_region_capacity * 2 : 64;
+        RegionSpan *grown = (RegionSpan *)realloc(free_regions, capacity * sizeof(RegionSpan));
+        if (!grown) {
+            return;
+        }
+        free_regions = grown;
+        free_region_capacity = capacity;
+    }
+    free_regions[free_region_num++] = RegionSpan {begin, end};
+}
+
+char *reserve_region(size_t bytes) {
+    char *reused = reuse_region(bytes);
+    if (reused) {
+        return reused;
+    }
+
+    char *begin = reserve_top.fetch_add(bytes);
+    if (!begin || begin + bytes > reserve_end.load()) {
+        return nullptr;
+    }
+    if (mprotect(begin, bytes, PROT_READ | PROT_WRITE) != 0) {
+        return nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(begin, bytes, MADV_HUGEPAGE);
+#endif
+    return begin;
+}
+
+bool is_arena_pointer(void *pointer) {
+    char *begin = reserve_begin.load(std::memory_order_relaxed);
+    return begin && (char *)pointer >= begin && (char *)pointer < reserve_end.load(std::memory_order_relaxed);
+}
+
+Arena *set_current_arena(Arena *arena) {
+    Arena *previous = current_arena;
+    current_arena = arena;
+    return previous;
+}
+
+// arena
+Arena::Arena() {
+    reserve_arena_space(default_arena_space);
+}
+
+Arena::~Arena() {
+    for (int i = 0; i < region_num; i++) {
+        return_region(regions[i].begin, regions[i].end);
+    }
+    free(regions);
+}
+
+char *Arena::bump(size_t bytes) {
+    // next kept region that fits, otherwise a new one
+    while (current < 0 || top + bytes > regions[current].end) {
+        if (current + 1 < region_num) {
+            current++;
+            top = regions[current].begin;
+            continue;
+        }
+
+        if (region_num == region_capacity) {
+            int capacity = region_capacity ? region_capacity * 2 : 16;
+            Region *grown = (Region *)realloc(regions, capacity * sizeof(Region));
+            if (!grown) {
+                return nullptr;
+            }
+            regions = grown;
+            region_capacity = capacity;
+        }
+
+        size_t size = (bytes + region_size - 1) / region_size * region_size;
+        char *begin = reserve_region(size);
+        if (!begin) {
+            return nullptr;
+        }
+        regions[region_num++] = Region {begin, begin + size};
+    }
+
+    char *pointer = top;
+    top += bytes;
+    return pointer;
+}
+
+void *Arena::allocate(size_t bytes) {
+    size_t size_class = 0;
+    while (size_class < class_num && ((size_t)16 << size_class) < bytes) {
+        size_class++;
+    }
+
+    // a freed block of the class, or the smallest freed large block that fits
+    void *pointer = nullptr;
+    size_t size = size_class < class_num ? (size_t)16 << size_class : (bytes + 15) / 16 * 16;
+    if (size_class < class_num && free_list[size_class]) {
+        pointer = free_list[size_class];
+        free_list[size_class] = *(void **)pointer;
+    } else if (size_class == class_num) {
+        void **best = nullptr;
+        for (void **link = &large_list; *link; link = (void **)*link) {
+            size_t block_size = ((ArenaHeader *)*link - 1)->size;
+            if (block_size >= size && (!best || block_size < ((ArenaHeader *)*best - 1)->size)) {
+                best = link;
+            }
+        }
+        if (best) {
+            pointer = *best;
+            *best = *(void **)pointer;
+        }
+    }
+
+    if (!pointer) {
+        char *block = bump(sizeof(ArenaHeader) + size);
+        if (!block) {
+            return nullptr;
+        }
+        *(ArenaHeader *)block = ArenaHeader {this, size};
+        pointer = block + sizeof(ArenaHeader);
+    }
+
+    used += ((ArenaHeader *)pointer - 1)->size;
+    high_water = used > high_water ? used : high_water;
+    return pointer;
+}
+
+void Arena::release(void *pointer) {
+    ArenaHeader *header = (ArenaHeader *)pointer - 1;
+    if (header->owner != this) {
+        return;
+    }
+    used -= header->size;
+
+    if (header->size > ((size_t)16 << (class_num - 1))) {
+        *(void **)pointer = large_list;
+        large_list = pointer;
+        return;
+    }
+    int size_class = __builtin_ctzll(header->size) - 4;
+    *(void **)pointer = free_list[size_class];
+    free_list[size_class] = pointer;
+}
+
+void Arena::reset() {
+    // regions stay mapped, the next conversion starts from the first one
+    current = region_num ? 0 : -1;
+    top = region_num ? regions[0].begin : nullptr;
+    used = 0;
+    for (int i = 0; i < class_num; i++) {
+        free_list[i] = nullptr;
+    }
+    large_list = nullptr;
+}
+
+size_t Arena::get_used() {
+    return used;
+}
+
+size_t Arena::get_high_water() {
+    return high_water;
+}
+
+// global operator new/delete, routed to the arena of the calling thread if it has one
+// opt in only, the host allocator is left alone otherwise
+#ifdef JPEG_ARENA
+
+void *allocate_memory(size_t bytes) {
+    if (current_arena) {
+        void *pointer = current_arena->allocate(bytes);
+        if (pointer) {
+            return pointer;
+        }
+    }
+    return malloc(bytes ? bytes : 1);
+}
+
+void release_memory(void *pointer) {
+    if (!pointer) {
+        return;
+    }
+    // blocks of an arena that is not current are dropped at its next reset
+    if (is_arena_pointer(pointer)) {
+        if (current_arena && ((ArenaHeader *)pointer - 1)->owner == current_arena) {
+            current_arena->release(pointer);
+        }
+        return;
+    }
+    free(pointer);
+}
+
+void *operator new(size_t bytes) {
+    void *pointer = allocate_memory(bytes);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void *operator new[](size_t bytes) {
+    return operator new(bytes);
+}
+
+void *operator new(size_t bytes, const std::nothrow_t &) noexcept {
+    return allocate_memory(bytes);
+}
+
+void *operator new[](size_t bytes, const std::nothrow_t &) noexcept {
+    return allocate_memory(bytes);
+}
+
+void operator delete(void *pointer) noexcept {
+    release_memory(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    release_memory(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    release_memory(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+    release_memory(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+    release_memory(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+    release_memory(pointer);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include <sstream>
+#include <thread>
+#include <algorithm>
+
+#include "async.hpp"
+#include "arena.hpp"
+
+typedef std::function<void(Arena &)> EncodeTask;
+
+// fixed pool started on the first async call
+class EncodePool {
+public:
+    EncodePool(int n_worker) : tasks(1 << 16) {
+        // statics are built here so they outlive the pool
+        warm_encoder_tables();
+
+        for (int t = 0; t < n_worker; t++) {
+            workers.push_back(std::thread([this] {
+                Arena arena;
+                warm_encoder_tables();
+                set_entropy_thread_num(1);
+
+                EncodeTask task;
+                while (tasks.pop(task)) {
+                    arena.reset();
+                    task(arena);
+                }
+            }));
+        }
+    }
+
+    ~EncodePool() {
+        tasks.close();
+        for (auto &t: workers) {
+            t.join();
+        }
+    }
+
+    void submit(EncodeTask task) {
+        tasks.push(std::move(task));
+    }
+
+private:
+    BoundedQueue<EncodeTask> tasks;
+    std::vector<std::thread> workers;
+};
+
+EncodePool &get_encode_pool() {
+    static EncodePool pool(std::max(1, (int)std::thread::hardware_concurrency()));
+    return pool;
+}
+
+struct EncodeControlScope {
+    EncodeControl *previous;
+
+    EncodeControlScope(EncodeControl &control) : previous(set_encode_control(&control)) {}
+    ~EncodeControlScope() { set_encode_control(previous); }
+};
+
+bool run_encode_task(PPM &image, std::string &output, PipelineEncoder &encode, EncodeControl &control, Arena &arena) {
+    if (is_encode_cancelled(&control)) {
+        return false;
+    }
+
+    // the stream lives outside the arena scope and is copied out before the next reset
+    std::ostringstream file(std::ios::binary);
+    bool done;
+    {
+        EncodeControlScope control_scope(control);
+        ArenaScope scope(arena);
+        done = encode(image, file);
+    }
+
+    if (!done || is_encode_cancelled(&control)) {
+        return false;
+    }
+    output = file.str();
+    return true;
+}
+
+std::future<bool> encode_jpeg_async(PPM &image, std::ostream &file, PipelineEncoder encode, EncodeControl &control) {
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+
+    get_encode_pool().submit([&image, &file, encode, &control, promise](Arena &arena) mutable {
+        try {
+            std::string output;
+            bool done = run_encode_task(image, output, encode, control, arena);
+            if (done) {
+                file.write(output.data(), output.size());
+            }
+            promise->set_value(done);
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+
+    return future;
+}
+
+std::future<bool> convert_jpeg_async(std::string in_filename, std::string out_filename, PipelineEncoder encode, EncodeControl &control) {
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+
+    get_encode_pool().submit([in_filename, out_filename, encode, &control, promise](Arena &arena) mutable {
+        try {
+            PPM image = load_PPM(in_filename);
+            if (!image.data) {
+                promise->set_value(false);
+                return;
+            }
+
+            std::string output;
+            bool done = run_encode_task(image, output, encode, control, arena);
+            delete[] image.data;
+
+            // the file is only created for a finished encode
+            if (done) {
+                std::ofstream file(out_filename, std::ios::binary);
+                file.write(output.data(), output.size());
+                file.close();
+                done = !file.fail();
+            }
+            promise->set_value(done);
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+
+    return future;
+}
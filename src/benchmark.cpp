@@ -0,0 +1,202 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <algorithm>
+
+#include "jpeg.hpp"
+#include "decoder.hpp"
+#include "benchmark.hpp"
+
+// quality metrics, over the area of the decoded image
+double get_PSNR(std::vector<std::vector<RGB>> &origin, std::vector<std::vector<RGB>> &decoded) {
+    double error = 0.0;
+    long long num = 0;
+
+    for (int i = 0; i < decoded.size(); i++) {
+        for (int j = 0; j < decoded[0].size(); j++) {
+            double r = origin[i][j].r - decoded[i][j].r;
+            double g = origin[i][j].g - decoded[i][j].g;
+            double b = origin[i][j].b - decoded[i][j].b;
+            error += r * r + g * g + b * b;
+            num += 3;
+        }
+    }
+
+    // identical images are capped at 99 dB
+    if (error == 0.0) {
+        return 99.0;
+    }
+    return std::min(99.0, 10.0 * std::log10(255.0 * 255.0 * num / error));
+}
+
+double get_SSIM(std::vector<std::vector<RGB>> &origin, std::vector<std::vector<RGB>> &decoded) {
+    // luma SSIM over 8x8 windows with stride 4
+    const int window = 8;
+    const int stride = 4;
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+
+    int height = decoded.size();
+    int width = decoded[0].size();
+    double SSIM = 0.0;
+    int num = 0;
+
+    auto luma = [](RGB &p) { return 0.299 * p.r + 0.587 * p.g + 0.114 * p.b; };
+
+    for (int row = 0; row + window <= height; row += stride) {
+        for (int col = 0; col + window <= width; col += stride) {
+            double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_yy = 0.0, sum_xy = 0.0;
+
+            for (int m = row; m < row + window; m++) {
+                for (int n = col; n < col + window; n++) {
+                    double x = luma(origin[m][n]);
+                    double y = luma(decoded[m][n]);
+                    sum_x += x;
+                    sum_y += y;
+                    sum_xx += x * x;
+                    sum_yy += y * y;
+                    sum_xy += x * y;
+                }
+            }
+
+            double n = window * window;
+            double mean_x = sum_x / n, mean_y = sum_y / n;
+            double var_x = sum_xx / n - mean_x * mean_x;
+            double var_y = sum_yy / n - mean_y * mean_y;
+            double cov = sum_xy / n - mean_x * mean_y;
+
+            SSIM += ((2 * mean_x * mean_y + c1) * (2 * cov + c2))
+                / ((mean_x * mean_x + mean_y * mean_y + c1) * (var_x + var_y + c2));
+            num++;
+        }
+    }
+
+    return num ? SSIM / num : 1.0;
+}
+
+// speed/quality regression harness
+std::vector<BenchmarkMode> get_benchmark_modes() {
+    static SampleSetting sample_setting = {8, 256, 0};
+
+    // minimum PSNR, SSIM profiled on sample/input_ppm with some margin
+    return {
+        {"normal", [](std::string &in, std::string &out) { return convert_normal_jpeg(in, out); }, 27.0, 0.82},
+        {"DHT", [](std::string &in, std::string &out) { return convert_adjusted_DHT_jpeg(in, out); }, 27.0, 0.82},
+        {"DQT_1", [](std::string &in, std::string &out) { return convert_adjusted_DQT_jpeg(in, out, 1.0); }, 27.0, 0.82},
+        {"DQT_10", [](std::string &in, std::string &out) { return convert_adjusted_DQT_jpeg(in, out, 10.0); }, 15.0, 0.45},
+        {"sampled_DHT", [](std::string &in, std::string &out) { return convert_sampled_DHT_jpeg(in, out, sample_setting); }, 27.0, 0.82},
+        {"sampled_DQT_1", [](std::string &in, std::string &out) { return convert_sampled_DQT_jpeg(in, out, 1.0, sample_setting); }, 27.0, 0.82},
+        // lambda 0 is plain rounding, the reference RDO has to be compared against
+        {"rounded", [](std::string &in, std::string &out) { return convert_RDO_jpeg(in, out, 0.0, 0); }, 28.0, 0.85},
+        {"RDO", [](std::string &in, std::string &out) { return convert_RDO_jpeg(in, out, 120.0, 0); }, 27.5, 0.82},
+        {"RDO_fast", [](std::string &in, std::string &out) { return convert_RDO_jpeg(in, out, 120.0, 1); }, 27.5, 0.82},
+        {"optimized", [](std::string &in, std::string &out) {
+            std::string tmp = out + ".tmp";
+            bool ok = convert_normal_jpeg(in, tmp) && convert_optimized_jpeg(tmp, out);
+            std::filesystem::remove(tmp);
+            return ok;
+        }, 27.0, 0.82}
+    };
+}
+
+BenchmarkResult run_benchmark_case(std::string &in_filename, std::string &out_filename, BenchmarkMode &mode, BenchmarkThreshold &threshold) {
+    BenchmarkResult result = {in_filename, mode.name, 0, 0.0, 0.0, 0.0, false};
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = mode.convert(in_filename, out_filename);
+    auto end = std::chrono::steady_clock::now();
+    result.encode_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    JPEG jpeg;
+    if (!ok || !load_JPEG(out_filename, jpeg)) {
+        return result;
+    }
+    result.size = std::filesystem::file_size(out_filename);
+
+    PPM image = load_PPM(in_filename);
+    std::vector<std::vector<RGB>> origin = PPM_data_to_vector(image);
+    std::vector<std::vector<RGB>> decoded = decode_JPEG_pixels(jpeg);
+    delete[] image.data;
+
+    result.PSNR = get_PSNR(origin, decoded);
+    result.SSIM = get_SSIM(origin, decoded);
+
+    double megapixel = 1e-6 * image.width * image.height;
+    result.pass = result.PSNR >= mode.min_PSNR + threshold.PSNR_offset
+        && result.SSIM >= std::max(mode.min_SSIM, threshold.min_SSIM)
+        && (threshold.max_ms_per_megapixel <= 0 || result.encode_ms <= threshold.max_ms_per_megapixel * megapixel);
+
+    return result;
+}
+
+int run_benchmark(std::string &in_folder, std::string &out_folder, BenchmarkThreshold &threshold) {
+    std::vector<std::string> in_files;
+    for (auto &entry: std::filesystem::directory_iterator(in_folder)) {
+        std::string ext = entry.path().extension().string();
+        if (ext == ".ppm" || ext == ".pgm") {
+            in_files.push_back(entry.path().string());
+        }
+    }
+    std::sort(in_files.begin(), in_files.end());
+
+    std::vector<BenchmarkMode> modes = get_benchmark_modes();
+    int fail_num = 0;
+
+    std::cout << std::left << std::setw(14) << "image" << std::setw(15) << "mode"
+        << std::right << std::setw(10) << "size" << std::setw(12) << "time (ms)"
+        << std::setw(10) << "PSNR" << std::setw(8) << "SSIM" << "\n";
+
+    for (auto &in_file: in_files) {
+        std::string name = std::filesystem::path(in_file).stem().string();
+
+        for (auto &mode: modes) {
+            std::string out_file = out_folder + name + "_bench_" + mode.name + ".jpg";
+            BenchmarkResult result = run_benchmark_case(in_file, out_file, mode, threshold);
+
+            std::cout << std::left << std::setw(14) << name << std::setw(15) << mode.name
+                << std::right << std::setw(10) << result.size
+                << std::fixed << std::setprecision(1) << std::setw(12) << result.encode_ms
+                << std::setprecision(2) << std::setw(10) << result.PSNR
+                << std::setprecision(4) << std::setw(8) << result.SSIM
+                << (result.pass ? "" : "  FAIL") << "\n";
+
+            fail_num += !result.pass;
+        }
+    }
+
+    // a missing and a truncated input have to fail cleanly in every mode, without an output file
+    std::string missing_file = out_folder + "missing.ppm";
+    std::string truncated_file = out_folder + "truncated.ppm";
+    std::filesystem::remove(missing_file);
+    if (!in_files.empty()) {
+        std::ifstream in(in_files[0], std::ios::binary);
+        std::vector<char> head(std::filesystem::file_size(in_files[0]) / 2);
+        in.read(head.data(), head.size());
+        std::ofstream(truncated_file, std::ios::binary).write(head.data(), head.size());
+    }
+
+    for (auto &bad_file: {missing_file, truncated_file}) {
+        std::string name = std::filesystem::path(bad_file).stem().string();
+
+        for (auto &mode: modes) {
+            std::string in_file = bad_file;
+            std::string out_file = out_folder + name + "_bench_" + mode.name + ".jpg";
+            std::filesystem::remove(out_file);
+
+            bool pass = !mode.convert(in_file, out_file) && !std::filesystem::exists(out_file);
+            if (!pass) {
+                std::cout << std::left << std::setw(14) << name << std::setw(15) << mode.name << "  FAIL, not rejected\n";
+            }
+            fail_num += !pass;
+        }
+    }
+    std::filesystem::remove(truncated_file);
+    std::cout << "Missing and truncated inputs checked in " << modes.size() << " modes.\n";
+
+    std::cout << (fail_num ? "Benchmark failed, " : "Benchmark passed, ") << fail_num << " case(s) crossed the threshold.\n";
+
+    return fail_num;
+}
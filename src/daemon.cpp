@@ -0,0 +1,366 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.hpp"
+#include "pipeline.hpp"
+#include "arena.hpp"
+
+// streams over recycled buffers
+MemoryInBuffer::MemoryInBuffer(char *data, long long size) {
+    setg(data, data, data + size);
+}
+
+VectorOutBuffer::VectorOutBuffer(std::vector<char> &data) : data(data) {}
+
+VectorOutBuffer::int_type VectorOutBuffer::overflow(int_type c) {
+    if (c != traits_type::eof()) {
+        data.push_back((char)c);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize VectorOutBuffer::xsputn(const char *s, std::streamsize n) {
+    data.insert(data.end(), s, s + n);
+    return n;
+}
+
+// socket io
+SocketReader::SocketReader(int fd, std::vector<char> &buffer) : fd(fd), buffer(buffer) {}
+
+bool SocketReader::fill() {
+    if (begin == end) {
+        begin = end = 0;
+    }
+    while (true) {
+        int n = read(fd, buffer.data() + end, buffer.size() - end);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        end += n;
+        return true;
+    }
+}
+
+bool SocketReader::read_line(std::string &line) {
+    line.clear();
+    while (true) {
+        for (int i = begin; i < end; i++) {
+            if (buffer[i] == '\n') {
+                line.append(buffer.data() + begin, i - begin);
+                begin = i + 1;
+                return true;
+            }
+        }
+        line.append(buffer.data() + begin, end - begin);
+        begin = end;
+        // a request line is never this long
+        if (line.size() > 4096 || !fill()) {
+            return false;
+        }
+    }
+}
+
+bool SocketReader::read_bytes(std::vector<char> &data, long long size) {
+    data.resize(size);
+
+    long long done = std::min<long long>(size, end - begin);
+    std::memcpy(data.data(), buffer.data() + begin, done);
+    begin += done;
+
+    // large payloads skip the read buffer
+    while (done < size) {
+        int n = read(fd, data.data() + done, std::min<long long>(size - done, 1 << 30));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool write_socket(int fd, const char *data, long long size) {
+    while (size > 0) {
+        int n = send(fd, data, std::min<long long>(size, 1 << 30), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// encode request
+bool parse_daemon_request(std::string &line, DaemonRequest &request) {
+    std::istringstream in(line);
+
+    request = {"", 1.0, "", "", "", 0};
+    in >> request.mode;
+    if (request.mode == "shutdown") {
+        request.source = "shutdown";
+        return true;
+    }
+
+    in >> request.scale >> request.source;
+    if (request.source == "path") {
+        in >> request.in_filename;
+        in >> request.out_filename;
+        return !request.in_filename.empty();
+    } else if (request.source == "inline") {
+        in >> request.size;
+        return !in.fail() && request.size > 0 && request.size <= (1LL << 30);
+    }
+    return false;
+}
+
+bool encode_by_mode(std::string &mode, float scale, PPM &image, std::ostream &file) {
+    static SampleSetting sample_setting = {8, 256, 0};
+
+    if (mode == "normal") {
+        encode_normal_jpeg(image, file);
+    } else if (mode == "DHT") {
+        encode_adjusted_DHT_jpeg(image, file);
+    } else if (mode == "DQT") {
+        encode_adjusted_DQT_jpeg(image, file, scale);
+    } else if (mode == "sampled_DHT") {
+        encode_sampled_DHT_jpeg(image, file, sample_setting);
+    } else if (mode == "sampled_DQT") {
+        encode_sampled_DQT_jpeg(image, file, scale, sample_setting);
+    } else if (mode == "RDO") {
+        encode_RDO_jpeg(image, file, scale, 0);
+    } else if (mode == "RDO_fast") {
+        encode_RDO_jpeg(image, file, scale, 1);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// per worker buffers, reused by every request it serves
+struct DaemonWorkspace {
+    std::vector<char> read_buffer = std::vector<char>(1 << 16);
+    std::vector<char> in_data;
+    Arena arena;
+};
+
+bool reply_error(int fd, std::string message) {
+    std::string line = "ERR " + message + "\n";
+    return write_socket(fd, line.data(), line.size());
+}
+
+bool serve_request(int fd, DaemonRequest &request, DaemonWorkspace &workspace, DaemonSetting &setting) {
+    // false when the connection is lost
+    // everything below comes from the arena, nothing outliving the request is touched
+    workspace.arena.reset();
+    ArenaScope scope(workspace.arena);
+
+    // load, the header may not claim more pixels than were sent
+    PPM image;
+    if (request.source == "inline") {
+        MemoryInBuffer buffer(workspace.in_data.data(), request.size);
+        std::istream file(&buffer);
+        image = load_PPM(file, std::min(request.size, setting.max_image_size));
+    } else {
+        std::ifstream file(request.in_filename, std::ios::binary | std::ios::ate);
+        if (!file.good()) {
+            return reply_error(fd, request.in_filename + " not found");
+        }
+        long long file_size = file.tellg();
+        file.seekg(0);
+        image = load_PPM(file, std::min(file_size, setting.max_image_size));
+    }
+
+    if (!image.data || image.width < 8 || image.height < 8) {
+        delete[] image.data;
+        return reply_error(fd, "bad image");
+    }
+
+    // encode
+    std::vector<char> data;
+    VectorOutBuffer buffer(data);
+    std::ostream file(&buffer);
+    bool known;
+    try {
+        known = encode_by_mode(request.mode, request.scale, image, file);
+    } catch (...) {
+        delete[] image.data;
+        throw;
+    }
+    delete[] image.data;
+
+    if (!known) {
+        return reply_error(fd, "unknown mode " + request.mode);
+    }
+
+    // reply
+    std::string reply;
+    if (!request.out_filename.empty()) {
+        std::ofstream out_file(request.out_filename, std::ios::binary);
+        out_file.write(data.data(), data.size());
+        out_file.close();
+
+        if (out_file.fail()) {
+            return reply_error(fd, "cannot write " + request.out_filename);
+        }
+        reply = "OK path " + request.out_filename + "\n";
+        return write_socket(fd, reply.data(), reply.size());
+    }
+    reply = "OK " + std::to_string(data.size()) + "\n";
+    return write_socket(fd, reply.data(), reply.size()) && write_socket(fd, data.data(), data.size());
+}
+
+void serve_connection(int fd, DaemonWorkspace &workspace, DaemonSetting &setting, std::atomic<bool> &stop, int listen_fd) {
+    SocketReader reader(fd, workspace.read_buffer);
+    std::string line;
+
+    // several requests may share a connection
+    while (reader.read_line(line)) {
+        DaemonRequest request;
+        if (!parse_daemon_request(line, request)) {
+            reply_error(fd, "bad request");
+            return;
+        }
+
+        if (request.source == "shutdown") {
+            if (!setting.allow_shutdown) {
+                reply_error(fd, "shutdown not allowed");
+                continue;
+            }
+            stop = true;
+            shutdown(listen_fd, SHUT_RDWR);
+            write_socket(fd, "OK shutdown\n", 12);
+            return;
+        }
+
+        if (request.source == "inline" && !reader.read_bytes(workspace.in_data, request.size)) {
+            return;
+        }
+
+        // a failing request never takes the daemon down
+        bool connected;
+        try {
+            connected = serve_request(fd, request, workspace, setting);
+        } catch (std::exception &e) {
+            connected = reply_error(fd, std::string("encode failed, ") + e.what());
+        }
+        if (!connected) {
+            return;
+        }
+    }
+}
+
+int run_daemon(std::string &socket_path, DaemonSetting &setting) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path " << socket_path << " is too long.\n";
+        return -1;
+    }
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        std::cerr << "Cannot listen on " << socket_path << ", " << std::strerror(errno) << ".\n";
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return -1;
+    }
+
+    BoundedQueue<int> connections(setting.queue_depth);
+    std::atomic<bool> stop(false);
+    std::atomic<int> served(0);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < setting.n_worker; t++) {
+        workers.push_back(std::thread([&] {
+            // shared tables are built before the first arena scope
+            DaemonWorkspace workspace;
+            warm_encoder_tables();
+            set_entropy_thread_num(1);
+
+            int fd;
+            while (connections.pop(fd)) {
+                serve_connection(fd, workspace, setting, stop, listen_fd);
+                close(fd);
+                served++;
+            }
+        }));
+    }
+
+    std::cout << "Listening on " << socket_path << " with " << setting.n_worker << " workers." << std::endl;
+
+    while (!stop) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        connections.push(fd);
+    }
+
+    connections.close();
+    for (auto &t: workers) {
+        t.join();
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    return served;
+}
+
+// client
+bool send_daemon_request(std::string &socket_path, std::string &line, std::vector<char> &payload, std::string &reply, std::vector<char> &data) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    std::string request = line + "\n";
+    bool ok = write_socket(fd, request.data(), request.size())
+        && write_socket(fd, payload.data(), payload.size());
+
+    std::vector<char> buffer(1 << 16);
+    SocketReader reader(fd, buffer);
+    ok = ok && reader.read_line(reply);
+
+    // OK <n_bytes> is followed by the JPEG bytes
+    data.clear();
+    if (ok && reply.compare(0, 3, "OK ") == 0 && reply.compare(0, 7, "OK path") != 0 && reply != "OK shutdown") {
+        ok = reader.read_bytes(data, std::stoll(reply.substr(3)));
+    }
+
+    close(fd);
+
+    return ok && reply.compare(0, 2, "OK") == 0;
+}
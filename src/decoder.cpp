@@ -0,0 +1,699 @@
+#include <iostream>
+#include <map>
+#include <cmath>
+
+#include "huffman.hpp"
+#include "jpeg.hpp"
+#include "decoder.hpp"
+
+// bit reader
+BitReader::BitReader(std::vector<unsigned char> &data, int pos) : data(data), pos(pos) {}
+
+int BitReader::get_bit() {
+    if (bit_count == 0) {
+        bit_buffer = 0;
+        if (pos < data.size()) {
+            if (data[pos] != 0xFF) {
+                bit_buffer = data[pos];
+                pos++;
+            } else if (pos + 1 < data.size() && data[pos + 1] == 0x00) {
+                bit_buffer = 0xFF;
+                pos += 2;
+            }
+            // otherwise a marker is reached, feed zero bits
+        }
+        bit_count = 8;
+    }
+
+    bit_count--;
+    return (bit_buffer >> bit_count) & 1;
+}
+
+int BitReader::get_bits(int length) {
+    int value = 0;
+    for (int i = 0; i < length; i++) {
+        value = (value << 1) | get_bit();
+    }
+    return value;
+}
+
+int BitReader::read_restart_marker() {
+    // drop the padding bits of the current byte
+    bit_count = 0;
+
+    if (pos + 1 < data.size() && data[pos] == 0xFF && data[pos + 1] >= 0xD0 && data[pos + 1] <= 0xD7) {
+        pos += 2;
+        return 1;
+    }
+    return 0;
+}
+
+// huffman decoding
+HuffmanDecoder preprocess_huffman_decoder(const std::vector<int> &table) {
+    HuffmanDecoder decoder;
+    decoder.symbols = std::vector<int>(table.begin() + 16, table.end());
+
+    int symbol_offset = 0;
+    int code = 0;
+
+    for (int i = 0; i < 16; i++) {
+        int num = table[i];
+        int n_bits = i + 1;
+
+        decoder.val_offset[n_bits] = symbol_offset - code;
+        decoder.max_code[n_bits] = num ? code + num - 1 : -1;
+
+        symbol_offset += num;
+        code += num;
+        code <<= 1;
+    }
+
+    return decoder;
+}
+
+int decode_huffman(HuffmanDecoder &decoder, BitReader &reader) {
+    int code = 0;
+
+    for (int n_bits = 1; n_bits <= 16; n_bits++) {
+        code = (code << 1) | reader.get_bit();
+        if (code <= decoder.max_code[n_bits]) {
+            return decoder.symbols[decoder.val_offset[n_bits] + code];
+        }
+    }
+
+    return -1;
+}
+
+int extend_VLI(int value, int len) {
+    if (len == 0) {
+        return 0;
+    }
+    return value < (1 << (len - 1)) ? value - (1 << len) + 1 : value;
+}
+
+// block order of a scan
+int get_JPEG_mcu_num(JPEG &jpeg, std::vector<int> &scan) {
+    if (scan.size() == 1) {
+        // non-interleaved scan, one block per MCU, no padding to whole MCUs
+        JPEGComponent &comp = jpeg.components[scan[0]];
+        int cols = ((jpeg.width * comp.h + jpeg.max_h - 1) / jpeg.max_h + 7) / 8;
+        int rows = ((jpeg.height * comp.v + jpeg.max_v - 1) / jpeg.max_v + 7) / 8;
+        return rows * cols;
+    }
+    return jpeg.mcu_rows * jpeg.mcu_cols;
+}
+
+void get_JPEG_mcu_blocks(JPEG &jpeg, std::vector<int> &scan, int mcu, std::vector<std::pair<int, int>> &mcu_blocks) {
+    mcu_blocks.clear();
+
+    if (scan.size() == 1) {
+        JPEGComponent &comp = jpeg.components[scan[0]];
+        int cols = ((jpeg.width * comp.h + jpeg.max_h - 1) / jpeg.max_h + 7) / 8;
+        mcu_blocks.push_back({scan[0], (mcu / cols) * comp.block_cols + mcu % cols});
+        return;
+    }
+
+    int mcu_row = mcu / jpeg.mcu_cols;
+    int mcu_col = mcu % jpeg.mcu_cols;
+    for (int c: scan) {
+        JPEGComponent &comp = jpeg.components[c];
+        for (int y = 0; y < comp.v; y++) {
+            for (int x = 0; x < comp.h; x++) {
+                mcu_blocks.push_back({c, (mcu_row * comp.v + y) * comp.block_cols + mcu_col * comp.h + x});
+            }
+        }
+    }
+}
+
+// parse
+int read_JPEG_scan(std::vector<unsigned char> &data, int pos, JPEG &jpeg) {
+    if (pos + 3 > data.size()) {
+        return -1;
+    }
+    int len = (data[pos] << 8) | data[pos + 1];
+    int n = data[pos + 2];
+    if (n < 1 || n > 4 || len < 6 + 2 * n || pos + len > data.size()) {
+        return -1;
+    }
+
+    std::vector<int> scan;
+    for (int i = 0; i < n; i++) {
+        int id = data[pos + 3 + 2 * i];
+        int table = data[pos + 4 + 2 * i];
+
+        // baseline allows tables 0 and 1 only
+        if ((table >> 4) > 1 || (table & 0x0F) > 1) {
+            return -1;
+        }
+
+        for (int c = 0; c < jpeg.components.size(); c++) {
+            if (jpeg.components[c].id == id) {
+                jpeg.components[c].dc_id = table >> 4;
+                jpeg.components[c].ac_id = table & 0x0F;
+                scan.push_back(c);
+            }
+        }
+    }
+
+    // baseline only, whole spectrum in one pass
+    int spectral_start = data[pos + 3 + 2 * n];
+    int spectral_end = data[pos + 4 + 2 * n];
+    int approximation = data[pos + 5 + 2 * n];
+    if (scan.size() != n || spectral_start != 0 || spectral_end != 63 || approximation != 0) {
+        return -1;
+    }
+
+    std::vector<HuffmanDecoder> dc_decoders(4), ac_decoders(4);
+    for (int c: scan) {
+        JPEGComponent &comp = jpeg.components[c];
+        if (jpeg.huffman_dc[comp.dc_id].empty() || jpeg.huffman_ac[comp.ac_id].empty()) {
+            return -1;
+        }
+        dc_decoders[comp.dc_id] = preprocess_huffman_decoder(jpeg.huffman_dc[comp.dc_id]);
+        ac_decoders[comp.ac_id] = preprocess_huffman_decoder(jpeg.huffman_ac[comp.ac_id]);
+    }
+
+    BitReader reader(data, pos + len);
+    std::vector<int> predictor(jpeg.components.size(), 0);
+    std::vector<std::pair<int, int>> mcu_blocks;
+
+    int mcu_num = get_JPEG_mcu_num(jpeg, scan);
+    for (int mcu = 0; mcu < mcu_num; mcu++) {
+        if (jpeg.restart_interval && mcu > 0 && mcu % jpeg.restart_interval == 0) {
+            if (!reader.read_restart_marker()) {
+                return -1;
+            }
+            predictor.assign(predictor.size(), 0);
+        }
+
+        get_JPEG_mcu_blocks(jpeg, scan, mcu, mcu_blocks);
+        for (auto &i: mcu_blocks) {
+            JPEGComponent &comp = jpeg.components[i.first];
+            std::vector<int> &block = comp.blocks[i.second];
+
+            // DC
+            int len = decode_huffman(dc_decoders[comp.dc_id], reader);
+            if (len < 0 || len > 15) {
+                return -1;
+            }
+            predictor[i.first] += extend_VLI(reader.get_bits(len), len);
+            block[0] = predictor[i.first];
+
+            // AC
+            for (int j = 1; j < 64; j++) {
+                int merge_num = decode_huffman(ac_decoders[comp.ac_id], reader);
+                if (merge_num < 0) {
+                    return -1;
+                }
+
+                int zero_cnt = merge_num >> 4;
+                int len = merge_num & 0x0F;
+                if (len == 0) {
+                    if (zero_cnt != 15) {
+                        break;
+                    }
+                    j += 15;
+                    continue;
+                }
+
+                j += zero_cnt;
+                if (j >= 64) {
+                    return -1;
+                }
+                block[j] = extend_VLI(reader.get_bits(len), len);
+            }
+        }
+    }
+
+    // skip padding up to the next marker
+    pos = reader.pos;
+    while (pos + 1 < data.size() && !(data[pos] == 0xFF && data[pos + 1] != 0x00)) {
+        pos++;
+    }
+
+    return pos;
+}
+
+bool load_JPEG(std::string &filename, JPEG &jpeg, long long max_size) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.good()) {
+        return false;
+    }
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    jpeg.restart_interval = 0;
+    jpeg.quan_tables.assign(4, std::vector<int>(0));
+    jpeg.huffman_dc.assign(4, std::vector<int>(0));
+    jpeg.huffman_ac.assign(4, std::vector<int>(0));
+    jpeg.components.clear();
+    jpeg.app_segments.clear();
+
+    if (data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+
+    std::vector<std::vector<int>> order = get_zigzag_order(8);
+    int pos = 2;
+
+    while (pos + 4 <= data.size()) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+
+        int marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9) {
+            break;
+        }
+
+        // every read below stays inside [seg, end)
+        int len = (data[pos + 2] << 8) | data[pos + 3];
+        int seg = pos + 4;
+        int end = pos + 2 + len;
+        if (len < 2 || end > data.size()) {
+            return false;
+        }
+
+        if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+            // APPn, COM
+            jpeg.app_segments.push_back(std::vector<unsigned char>(data.begin() + pos, data.begin() + end));
+        } else if (marker == 0xDB) {
+            // DQT
+            for (int p = seg; p < end; p += 65) {
+                if (p + 65 > end || data[p] >> 4) {
+                    return false;   // 16 bits precision
+                }
+
+                std::vector<int> &table = jpeg.quan_tables[data[p] & 0x03];
+                table.assign(64, 0);
+                for (int i = 0; i < 64; i++) {
+                    table[order[i][0] * 8 + order[i][1]] = data[p + 1 + i];
+                }
+            }
+        } else if (marker == 0xC0) {
+            // SOF0, SOF1 is rejected below since it is written back as SOF0
+            if (len < 8 || data[seg] != 8) {
+                return false;
+            }
+
+            jpeg.height = (data[seg + 1] << 8) | data[seg + 2];
+            jpeg.width = (data[seg + 3] << 8) | data[seg + 4];
+            jpeg.max_h = 1;
+            jpeg.max_v = 1;
+
+            int n = data[seg + 5];
+            if (n < 1 || n > 4 || len < 8 + 3 * n || jpeg.height == 0 || jpeg.width == 0 || !jpeg.components.empty()) {
+                return false;
+            }
+            for (int i = 0; i < n; i++) {
+                JPEGComponent comp = {};
+                comp.id = data[seg + 6 + 3 * i];
+                comp.h = data[seg + 7 + 3 * i] >> 4;
+                comp.v = data[seg + 7 + 3 * i] & 0x0F;
+                comp.quan_id = data[seg + 8 + 3 * i] & 0x03;
+                comp.dc_id = 0;
+                comp.ac_id = 0;
+                if (comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4) {
+                    return false;
+                }
+
+                jpeg.max_h = std::max(jpeg.max_h, comp.h);
+                jpeg.max_v = std::max(jpeg.max_v, comp.v);
+                jpeg.components.push_back(comp);
+            }
+
+            jpeg.mcu_cols = (jpeg.width + 8 * jpeg.max_h - 1) / (8 * jpeg.max_h);
+            jpeg.mcu_rows = (jpeg.height + 8 * jpeg.max_v - 1) / (8 * jpeg.max_v);
+
+            // checked before allocating, a block takes at least 2 bits of the entropy data after this segment
+            long long block_num = 0;
+            for (auto &comp: jpeg.components) {
+                block_num += (long long)jpeg.mcu_rows * comp.v * jpeg.mcu_cols * comp.h;
+            }
+            if (block_num * 64 > max_size || block_num > 4LL * (long long)(data.size() - end)) {
+                return false;
+            }
+            for (auto &comp: jpeg.components) {
+                comp.block_cols = jpeg.mcu_cols * comp.h;
+                comp.block_rows = jpeg.mcu_rows * comp.v;
+                comp.blocks.assign(comp.block_rows * comp.block_cols, std::vector<int>(64, 0));
+            }
+        } else if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // extended, progressive, lossless, arithmetic
+            return false;
+        } else if (marker == 0xC4) {
+            // DHT
+            for (int p = seg; p < end;) {
+                if (p + 17 > end || (data[p] >> 4) > 1) {
+                    return false;
+                }
+
+                int num = 0;
+                for (int i = 0; i < 16; i++) {
+                    num += data[p + 1 + i];
+                }
+                if (num > 256 || p + 17 + num > end) {
+                    return false;
+                }
+
+                std::vector<int> table(data.begin() + p + 1, data.begin() + p + 17);
+                table.insert(table.end(), data.begin() + p + 17, data.begin() + p + 17 + num);
+
+                if (data[p] >> 4) {
+                    jpeg.huffman_ac[data[p] & 0x03] = table;
+                } else {
+                    jpeg.huffman_dc[data[p] & 0x03] = table;
+                }
+                p += 17 + num;
+            }
+        } else if (marker == 0xDD) {
+            // DRI
+            if (len < 4) {
+                return false;
+            }
+            jpeg.restart_interval = (data[seg] << 8) | data[seg + 1];
+        } else if (marker == 0xDA) {
+            // SOS
+            if (jpeg.components.empty()) {
+                return false;
+            }
+
+            pos = read_JPEG_scan(data, pos + 2, jpeg);
+            if (pos < 0) {
+                return false;
+            }
+            continue;
+        }
+
+        pos = end;
+    }
+
+    if (jpeg.components.empty()) {
+        return false;
+    }
+    for (auto &comp: jpeg.components) {
+        if (jpeg.quan_tables[comp.quan_id].size() != 64) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// re-encode coefficients
+void write_JPEG_SOF0_section(std::ostream &file, JPEG &jpeg) {
+    int SOF0_len = 2 + 1 + 2 + 2 + 1 + jpeg.components.size() * 3;
+    file.put(0xFF);
+    file.put(0xC0);
+    file.put(SOF0_len >> 8);
+    file.put(SOF0_len >> 0);
+    file.put(0x08);
+    file.put(jpeg.height >> 8);
+    file.put(jpeg.height >> 0);
+    file.put(jpeg.width >> 8);
+    file.put(jpeg.width >> 0);
+    file.put(jpeg.components.size());
+
+    for (auto &comp: jpeg.components) {
+        file.put(comp.id); file.put((comp.h << 4) | comp.v); file.put(comp.quan_id);
+    }
+}
+
+void write_JPEG_SOS_section(std::ostream &file, JPEG &jpeg) {
+    int SOS_len = 2 + 1 + 2 * jpeg.components.size() + 3;
+
+    file.put(0xFF);
+    file.put(0xDA);
+    file.put(SOS_len >> 8);
+    file.put(SOS_len >> 0);
+    file.put(jpeg.components.size());
+
+    for (auto &comp: jpeg.components) {
+        file.put(comp.id); file.put((comp.dc_id << 4) | comp.ac_id);
+    }
+
+    file.put(0x00);
+    file.put(0x3F);
+    file.put(0x00);
+}
+
+void write_JPEG_data_section(std::ostream &file, JPEG &jpeg, int get_statistics, std::vector<void *> &huffman_ac, std::vector<void *> &huffman_dc) {
+    // all components in one scan, no restart interval
+    BitVector bit_data;
+
+    std::vector<int> scan;
+    for (int c = 0; c < jpeg.components.size(); c++) {
+        scan.push_back(c);
+    }
+
+    std::vector<int> predictor(jpeg.components.size(), 0);
+    std::vector<std::pair<int, int>> mcu_blocks;
+
+    int mcu_num = get_JPEG_mcu_num(jpeg, scan);
+    for (int mcu = 0; mcu < mcu_num; mcu++) {
+        get_JPEG_mcu_blocks(jpeg, scan, mcu, mcu_blocks);
+        for (auto &i: mcu_blocks) {
+            JPEGComponent &comp = jpeg.components[i.first];
+            std::vector<int> &block = comp.blocks[i.second];
+
+            encode_block(
+                block, block[0] - predictor[i.first],
+                get_statistics,
+                huffman_ac[comp.ac_id],
+                huffman_dc[comp.dc_id],
+                bit_data
+            );
+            predictor[i.first] = block[0];
+        }
+    }
+
+    if (!get_statistics) {
+        bit_data.write_binary(file);
+    }
+}
+
+void optimize_JPEG_huffman(JPEG &jpeg) {
+    std::vector<std::vector<int>> ac_cnt(4, std::vector<int>(0xFF + 1, 0));
+    std::vector<std::vector<int>> dc_cnt(4, std::vector<int>(0xFF + 1, 0));
+    std::vector<void *> huffman_ac, huffman_dc;
+    for (int i = 0; i < 4; i++) {
+        huffman_ac.push_back(&ac_cnt[i]);
+        huffman_dc.push_back(&dc_cnt[i]);
+    }
+
+    std::ofstream useless_file;
+    write_JPEG_data_section(useless_file, jpeg, 1, huffman_ac, huffman_dc);
+
+    for (auto &comp: jpeg.components) {
+        jpeg.huffman_ac[comp.ac_id] = huffman_encode(ac_cnt[comp.ac_id]);
+        jpeg.huffman_dc[comp.dc_id] = huffman_encode(dc_cnt[comp.dc_id]);
+    }
+}
+
+void write_JPEG(std::ostream &file, JPEG &jpeg) {
+    std::vector<int> quan_used(4, 0), ac_used(4, 0), dc_used(4, 0);
+    for (auto &comp: jpeg.components) {
+        quan_used[comp.quan_id] = 1;
+        ac_used[comp.ac_id] = 1;
+        dc_used[comp.dc_id] = 1;
+    }
+
+    std::vector<std::map<int, HuffmanInfo>> huffman_info_ac(4), huffman_info_dc(4);
+    std::vector<void *> huffman_ac, huffman_dc;
+    for (int i = 0; i < 4; i++) {
+        if (ac_used[i]) {
+            huffman_info_ac[i] = preprocess_DHT(jpeg.huffman_ac[i]);
+        }
+        if (dc_used[i]) {
+            huffman_info_dc[i] = preprocess_DHT(jpeg.huffman_dc[i]);
+        }
+        huffman_ac.push_back(&huffman_info_ac[i]);
+        huffman_dc.push_back(&huffman_info_dc[i]);
+    }
+
+    // SOI
+    write_SOI_section(file);
+
+    // APPn, COM
+    for (auto &segment: jpeg.app_segments) {
+        file.write((char *)segment.data(), segment.size());
+    }
+
+    // DQT
+    for (int i = 0; i < 4; i++) {
+        if (quan_used[i]) {
+            write_DQT_section(file, i, jpeg.quan_tables[i]);
+        }
+    }
+
+    // SOF0
+    write_JPEG_SOF0_section(file, jpeg);
+
+    // DHT AC, DC
+    for (int i = 0; i < 4; i++) {
+        if (ac_used[i]) {
+            write_huffman_section(file, i + 0x10, jpeg.huffman_ac[i]);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        if (dc_used[i]) {
+            write_huffman_section(file, i + 0x00, jpeg.huffman_dc[i]);
+        }
+    }
+
+    // SOS
+    write_JPEG_SOS_section(file, jpeg);
+
+    // data
+    write_JPEG_data_section(file, jpeg, 0, huffman_ac, huffman_dc);
+
+    // EOI
+    write_EOI_section(file);
+}
+
+void write_JPEG(std::string &filename, JPEG &jpeg) {
+    std::ofstream file(filename, std::ios::binary);
+    write_JPEG(file, jpeg);
+
+    file.flush();
+    file.close();
+}
+
+// pixel reconstruction
+std::vector<double> get_IDCT_table(int block) {
+    // alpha(k) * cos((2m + 1) k pi / 2N)
+    std::vector<double> cos_table(block * block, 0.0);
+    for (int m = 0; m < block; m++) {
+        for (int k = 0; k < block; k++) {
+            double alpha = k == 0 ? std::sqrt(1.0 / block) : std::sqrt(2.0 / block);
+            cos_table[m * block + k] = alpha * std::cos((2.0 * m + 1.0) * k * M_PI / (2.0 * block));
+        }
+    }
+    return cos_table;
+}
+
+void inverse_2d_DCT(std::vector<double> &block_data, int block, const std::vector<double> &cos_table) {
+    std::vector<double> tmp_block_data(block * block, 0.0);
+
+    // columns, then rows
+    for (int m = 0; m < block; m++) {
+        for (int l = 0; l < block; l++) {
+            double tmp = 0.0;
+            for (int k = 0; k < block; k++) {
+                tmp += cos_table[m * block + k] * block_data[k * block + l];
+            }
+            tmp_block_data[m * block + l] = tmp;
+        }
+    }
+
+    for (int m = 0; m < block; m++) {
+        for (int n = 0; n < block; n++) {
+            double tmp = 0.0;
+            for (int l = 0; l < block; l++) {
+                tmp += cos_table[n * block + l] * tmp_block_data[m * block + l];
+            }
+            block_data[m * block + n] = tmp;
+        }
+    }
+}
+
+std::vector<std::vector<double>> decode_JPEG_component(JPEG &jpeg, JPEGComponent &comp) {
+    const int block = 8;
+
+    std::vector<std::vector<int>> order = get_zigzag_order(block);
+    std::vector<int> &quan = jpeg.quan_tables[comp.quan_id];
+    std::vector<std::vector<double>> plane(comp.block_rows * block, std::vector<double>(comp.block_cols * block, 0.0));
+    std::vector<double> block_data(block * block);
+    // per call, components are decoded on several threads at a time
+    std::vector<double> cos_table = get_IDCT_table(block);
+
+    for (int i = 0; i < comp.blocks.size(); i++) {
+        int row = i / comp.block_cols * block;
+        int col = i % comp.block_cols * block;
+
+        for (int j = 0; j < order.size(); j++) {
+            int index = order[j][0] * block + order[j][1];
+            block_data[index] = comp.blocks[i][j] * quan[index];
+        }
+
+        inverse_2d_DCT(block_data, block, cos_table);
+
+        for (int m = 0; m < block; m++) {
+            for (int n = 0; n < block; n++) {
+                plane[row + m][col + n] = block_data[m * block + n] + 128.0;
+            }
+        }
+    }
+
+    return plane;
+}
+
+int clamp_pixel(double value) {
+    return std::min(255, std::max(0, around(value)));
+}
+
+std::vector<std::vector<RGB>> decode_JPEG_pixels(JPEG &jpeg) {
+    std::vector<std::vector<std::vector<double>>> planes;
+    for (auto &comp: jpeg.components) {
+        planes.push_back(decode_JPEG_component(jpeg, comp));
+    }
+
+    // inverse of the matrix used by RGB_to_YCbCr
+    static const double m[3][3] = {
+        {0.257, 0.564, 0.098},
+        {-0.148, -0.291, 0.439},
+        {0.439, -0.368, -0.071}
+    };
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+        - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+        + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    double inv[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+            int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+        }
+    }
+
+    std::vector<std::vector<RGB>> RGB_data(std::vector(jpeg.height, std::vector(jpeg.width, RGB {0, 0, 0})));
+    for (int i = 0; i < jpeg.height; i++) {
+        for (int j = 0; j < jpeg.width; j++) {
+            // a missing chroma plane decodes as neutral
+            double value[3] = {0.0, 128.0, 128.0};
+            for (int c = 0; c < planes.size() && c < 3; c++) {
+                JPEGComponent &comp = jpeg.components[c];
+                value[c] = planes[c][i * comp.v / jpeg.max_v][j * comp.h / jpeg.max_h];
+            }
+
+            if (planes.size() == 1) {
+                int gray = clamp_pixel(value[0]);
+                RGB_data[i][j] = RGB {gray, gray, gray};
+                continue;
+            }
+
+            double y = value[0] - 16.0, cb = value[1] - 128.0, cr = value[2] - 128.0;
+            RGB_data[i][j].r = clamp_pixel(inv[0][0] * y + inv[0][1] * cb + inv[0][2] * cr);
+            RGB_data[i][j].g = clamp_pixel(inv[1][0] * y + inv[1][1] * cb + inv[1][2] * cr);
+            RGB_data[i][j].b = clamp_pixel(inv[2][0] * y + inv[2][1] * cb + inv[2][2] * cr);
+        }
+    }
+
+    return RGB_data;
+}
+
+// convert
+bool convert_optimized_jpeg(std::string &in_filename, std::string &out_filename) {
+    JPEG jpeg;
+    if (!load_JPEG(in_filename, jpeg)) {
+        return false;
+    }
+
+    optimize_JPEG_huffman(jpeg);
+    write_JPEG(out_filename, jpeg);
+
+    return true;
+}
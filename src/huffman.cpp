@@ -2,6 +2,7 @@
 #include <queue>
 
 #include "huffman.hpp"
+#include "trace.hpp"
 
 Node::Node(int data, int freq, Node *l=nullptr, Node *r=nullptr){
 	this->data = data;
@@ -36,7 +37,25 @@ void cleanup(Node *node){
 	}
 }
 
+void limit_code_length(std::vector<int> &bits, int max_length) {
+	for (int i = bits.size() - 1; i > max_length; i--) {
+		while (bits[i] > 0) {
+			int j = i - 2;
+			while (bits[j] == 0) {
+				j--;
+			}
+
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+}
+
 std::vector<int> huffman_encode(std::vector<int> &freq) {
+	TRACE_ZONE("huffman_encode");
+
 	Node *l, *r, *top;
 	std::priority_queue<Node *, std::vector<Node *>, NodeCompare> q;
 
@@ -65,9 +84,18 @@ std::vector<int> huffman_encode(std::vector<int> &freq) {
 	std::map<int, std::vector<int>> huffman_info;
 	get_tree_info(q.top(), 0, huffman_info);
 
+	// code length of depth d is d + 1, limit it to 16 bits (JPEG annex K.2)
+	std::vector<int> bits(std::max(huffman_info.rbegin()->first + 2, 17), 0);
+	for (auto &i: huffman_info) {
+		bits[i.first + 1] += i.second.size();
+	}
+	limit_code_length(bits, 16);
+
 	std::vector<int> huffman_table(16, 0);
+	for (int i = 1; i <= 16; i++) {
+		huffman_table[i - 1] = bits[i];
+	}
 	for (auto &i: huffman_info) {
-		huffman_table[std::min(i.first, 15)] += i.second.size();
 		for (int j = 0; j < i.second.size(); j++) {
 			huffman_table.push_back(i.second[j]);
 		}
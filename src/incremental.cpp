@@ -0,0 +1,250 @@
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+#include "huffman.hpp"
+#include "incremental.hpp"
+
+void update_YCbCr_block(IncrementalJPEG &state, PPM &image, int row, int col) {
+    const int block = 8;
+
+    for (int m = row; m < row + block; m++) {
+        unsigned char *offset = image.data + (m * image.width + col) * image.channel;
+
+        // keep the pixels to diff the next frame against
+        std::memcpy(&state.pixels[(m * state.width + col) * state.n_channel], offset, block * state.n_channel);
+
+        for (int n = col; n < col + block; n++, offset += image.channel) {
+            if (image.channel == 1) {
+                state.YCbCr_data[m][n] = dYCbCr {(double)*offset, 128.0, 128.0};
+            } else {
+                RGB pixel = {*offset, *(offset + 1), *(offset + 2)};
+                state.YCbCr_data[m][n] = pixel_to_YCbCr(pixel);
+            }
+        }
+    }
+}
+
+std::vector<unsigned char> encode_restart_interval(IncrementalJPEG &state, int interval) {
+    int block_num = state.blocks_data.size();
+    int begin = interval * state.restart_interval;
+    int end = std::min(begin + state.restart_interval, block_num);
+
+    BitVector bit_data;
+    std::vector<int> block(64);
+
+    for (int i = begin; i < end; i++) {
+        for (int channel = 0; channel < state.n_channel; channel++) {
+            for (int j = 0; j < block.size(); j++) {
+                block[j] = (channel == 0) ? state.blocks_data[i][j].y
+                    : (channel == 1) ? state.blocks_data[i][j].cb
+                    : state.blocks_data[i][j].cr;
+            }
+
+            // the DC predictor restarts at 0 with every interval
+            int dc_value = block[0];
+            if (i != begin) {
+                dc_value -= (channel == 0) ? state.blocks_data[i - 1][0].y
+                    : (channel == 1) ? state.blocks_data[i - 1][0].cb
+                    : state.blocks_data[i - 1][0].cr;
+            }
+
+            encode_block(
+                block, dc_value,
+                0,
+                &state.huffman_info[channel == 0 ? 0 : 2],
+                &state.huffman_info[channel == 0 ? 1 : 3],
+                bit_data
+            );
+        }
+    }
+
+    // pad the last byte with 1 bits, then drop the empty byte BitVector keeps open
+    if (bit_data.space != 7) {
+        bit_data.add_bits((1 << (bit_data.space + 1)) - 1, bit_data.space + 1);
+    }
+    bit_data.data.pop_back();
+
+    std::vector<unsigned char> segment;
+    segment.reserve(bit_data.data.size() + bit_data.data.size() / 64);
+    for (unsigned char byte: bit_data.data) {
+        segment.push_back(byte);
+        if (byte == 0xFF) {
+            segment.push_back(0x00);
+        }
+    }
+
+    return segment;
+}
+
+void init_incremental_jpeg(IncrementalJPEG &state, PPM &image, int restart_interval, int adjusted_DHT) {
+    const int block = 8;
+
+    state.height = image.height - image.height % block;
+    state.width = image.width - image.width % block;
+    state.n_channel = image.channel;
+    state.adjusted_DHT = adjusted_DHT;
+
+    int block_num = (state.height / block) * (state.width / block);
+    restart_interval = restart_interval > 0 ? restart_interval : state.width / block;
+    state.restart_interval = std::min(std::max(restart_interval, 1), 0xFFFF);
+
+    state.pixels.assign(state.height * state.width * state.n_channel, 0);
+    for (int i = 0; i < state.height; i++) {
+        std::memcpy(&state.pixels[i * state.width * state.n_channel], image.data + i * image.width * image.channel, state.width * state.n_channel);
+    }
+
+    state.YCbCr_data = image_to_YCbCr(image);
+    state.blocks_data = do_partition_process(state.YCbCr_data, quan_lum, quan_chrom, state.n_channel);
+
+    // tables stay fixed across updates, adjusted ones keep a code for every symbol
+    if (adjusted_DHT) {
+        std::vector<std::vector<int>> cnt(4, std::vector<int>(0xFF + 1, 0));
+
+        std::ofstream useless_file;
+        write_data_section(
+            useless_file, state.blocks_data,
+            1,
+            &cnt[0],
+            &cnt[1],
+            &cnt[2],
+            &cnt[3],
+            nullptr,
+            state.n_channel
+        );
+
+        for (int k = 0; k < 4; k++) {
+            add_fallback_frequency(cnt[k], k % 2 == 0);
+            state.huffman_tables[k] = huffman_encode(cnt[k]);
+        }
+    } else {
+        state.huffman_tables[0] = huffman_lum_ac;
+        state.huffman_tables[1] = huffman_lum_dc;
+        state.huffman_tables[2] = huffman_chrom_ac;
+        state.huffman_tables[3] = huffman_chrom_dc;
+    }
+
+    for (int k = 0; k < 4; k++) {
+        state.huffman_info[k] = preprocess_DHT(state.huffman_tables[k]);
+    }
+
+    // header
+    std::ostringstream file(std::ios::binary);
+    write_SOI_section(file);
+    write_DQT_section(file, 0, quan_lum);
+    if (state.n_channel == 3) {
+        write_DQT_section(file, 1, quan_chrom);
+    }
+    write_SOF0_section(file, state.height, state.width, state.n_channel);
+    write_huffman_section(file, 0 + 0x10, state.huffman_tables[0]);
+    if (state.n_channel == 3) {
+        write_huffman_section(file, 1 + 0x10, state.huffman_tables[2]);
+    }
+    write_huffman_section(file, 0 + 0x00, state.huffman_tables[1]);
+    if (state.n_channel == 3) {
+        write_huffman_section(file, 1 + 0x00, state.huffman_tables[3]);
+    }
+    write_DRI_section(file, state.restart_interval);
+    write_SOS_section(file, state.n_channel);
+
+    std::string header = file.str();
+    state.header.assign(header.begin(), header.end());
+
+    // data
+    int interval_num = (block_num + state.restart_interval - 1) / state.restart_interval;
+    state.segments.resize(interval_num);
+    for (int k = 0; k < interval_num; k++) {
+        state.segments[k] = encode_restart_interval(state, k);
+    }
+}
+
+int update_incremental_jpeg(IncrementalJPEG &state, PPM &image, std::vector<DirtyRect> *rects) {
+    const int block = 8;
+
+    int block_cols = state.width / block;
+    int block_num = state.blocks_data.size();
+
+    // a new size starts over with the same settings
+    if (image.height - image.height % block != state.height || image.width - image.width % block != state.width || image.channel != state.n_channel) {
+        init_incremental_jpeg(state, image, state.restart_interval, state.adjusted_DHT);
+        return state.segments.size();
+    }
+
+    // dirty blocks
+    std::vector<char> dirty(block_num, 0);
+    if (rects) {
+        for (DirtyRect &rect: *rects) {
+            int top = std::max(rect.row, 0);
+            int left = std::max(rect.col, 0);
+            int bottom = std::min(rect.row + rect.height, state.height);
+            int right = std::min(rect.col + rect.width, state.width);
+
+            for (int i = top / block; i * block < bottom; i++) {
+                for (int j = left / block; j * block < right; j++) {
+                    dirty[i * block_cols + j] = 1;
+                }
+            }
+        }
+    } else {
+        int row_size = block * state.n_channel;
+        for (int i = 0; i < block_num; i++) {
+            int row = i / block_cols * block;
+            int col = i % block_cols * block;
+
+            for (int m = row; m < row + block && !dirty[i]; m++) {
+                dirty[i] = std::memcmp(
+                    &state.pixels[(m * state.width + col) * state.n_channel],
+                    image.data + (m * image.width + col) * image.channel,
+                    row_size
+                ) != 0;
+            }
+        }
+    }
+
+    // recompute dirty blocks, an interval is only re-encoded if a coefficient changed
+    std::vector<char> dirty_interval(state.segments.size(), 0);
+    for (int i = 0; i < block_num; i++) {
+        if (!dirty[i]) {
+            continue;
+        }
+
+        int row = i / block_cols * block;
+        int col = i % block_cols * block;
+
+        update_YCbCr_block(state, image, row, col);
+        std::vector<iYCbCr> block_data = do_block_process(state.YCbCr_data, row, col, quan_lum, quan_chrom, state.n_channel);
+
+        bool changed = !std::equal(block_data.begin(), block_data.end(), state.blocks_data[i].begin(), [](iYCbCr &a, iYCbCr &b) {
+            return a.y == b.y && a.cb == b.cb && a.cr == b.cr;
+        });
+        if (changed) {
+            state.blocks_data[i] = block_data;
+            dirty_interval[i / state.restart_interval] = 1;
+        }
+    }
+
+    int encoded_num = 0;
+    for (int k = 0; k < state.segments.size(); k++) {
+        if (dirty_interval[k]) {
+            state.segments[k] = encode_restart_interval(state, k);
+            encoded_num++;
+        }
+    }
+
+    return encoded_num;
+}
+
+void write_incremental_jpeg(std::ostream &file, IncrementalJPEG &state) {
+    file.write((char *)state.header.data(), state.header.size());
+
+    // untouched segments are spliced byte for byte, RSTn between intervals
+    for (int k = 0; k < state.segments.size(); k++) {
+        if (k != 0) {
+            file.put(0xFF);
+            file.put(0xD0 + (k - 1) % 8);
+        }
+        file.write((char *)state.segments[k].data(), state.segments[k].size());
+    }
+
+    write_EOI_section(file);
+}
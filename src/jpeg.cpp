@@ -1,14 +1,23 @@
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <iostream>
 #include <cassert>
+#include <random>
+#include <algorithm>
+#include <thread>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "huffman.hpp"
 #include "jpeg.hpp"
+#include "trace.hpp"
 
 // PPM
-void remove_PPM_comment(std::ifstream &file) {
-    static char buf[1024];
+void remove_PPM_comment(std::istream &file) {
+    static thread_local char buf[1024];
 
     char c;
     while (c = file.peek()) {
@@ -22,11 +31,7 @@ void remove_PPM_comment(std::ifstream &file) {
     }
 }
 
-PPM load_PPM(std::string &filename) {
-    std::ifstream file(filename, std::ios::binary);
-    PPM image;
-    int size;
-
+bool read_PPM_header(std::istream &file, PPM &image, long long max_size) {
     remove_PPM_comment(file);
     file >> image.version;
     remove_PPM_comment(file);
@@ -34,12 +39,52 @@ PPM load_PPM(std::string &filename) {
     remove_PPM_comment(file);
     file >> image.max_value;
 
-    size = image.width * image.height * 3;
+    // P5 (PGM) is grayscale, P6 is RGB, the size is checked before allocating
+    image.channel = image.version == "P5" ? 1 : 3;
+
+    // malformed header or too large
+    return file && (image.version == "P5" || image.version == "P6") && image.width > 0 && image.height > 0
+        && image.max_value >= 1 && image.max_value <= 255 && image.width <= max_size / image.height / image.channel;
+}
+
+PPM load_PPM(std::istream &file, long long max_size) {
+    TRACE_ZONE("load_PPM");
+
+    PPM image;
+    long long size;
+
+    // no pixel data
+    if (!read_PPM_header(file, image, max_size)) {
+        image.width = image.height = 0;
+        image.channel = 0;
+        image.data = nullptr;
+        return image;
+    }
+
+    size = (long long)image.width * image.height * image.channel;
     image.data = new unsigned char[size];
 
     remove_PPM_comment(file);
     file.read((char *)image.data, size);
 
+    // truncated pixel data
+    if (file.gcount() != size) {
+        delete[] image.data;
+        image.width = image.height = 0;
+        image.channel = 0;
+        image.data = nullptr;
+    }
+
+    return image;
+}
+
+PPM load_PPM(std::string &filename) {
+    // the pixel data is never larger than the file
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    long long file_size = file ? (long long)file.tellg() : 0;
+    file.seekg(0);
+    PPM image = load_PPM(file, std::min(file_size, PPM_max_size));
+
     file.close();
 
     return image;
@@ -50,8 +95,9 @@ std::vector<std::vector<RGB>> PPM_data_to_vector(PPM &image) {
 
     for (int i = 0; i < image.height; i++) {
         for (int j = 0; j < image.width; j++) {
-            unsigned char *offset = image.data + i * image.width * 3 + j * 3;
-            RGB_data[i][j] = RGB {*offset, *(offset + 1), *(offset + 2)};
+            unsigned char *offset = image.data + (i * image.width + j) * image.channel;
+            RGB_data[i][j] = image.channel == 1 ? RGB {*offset, *offset, *offset}
+                : RGB {*offset, *(offset + 1), *(offset + 2)};
         }
     }
 
@@ -59,14 +105,45 @@ std::vector<std::vector<RGB>> PPM_data_to_vector(PPM &image) {
 }
 
 // RGB to YCbCr
+std::vector<std::vector<dYCbCr>> gray_to_YCbCr(PPM &image) {
+    TRACE_ZONE("gray_to_YCbCr");
+
+    std::vector<std::vector<dYCbCr>> YCbCr_data(std::vector(image.height, std::vector(image.width, dYCbCr {0.0, 128.0, 128.0})));
+
+    for (int i = 0; i < image.height; i++) {
+        for (int j = 0; j < image.width; j++) {
+            YCbCr_data[i][j].y = image.data[i * image.width + j];
+        }
+    }
+
+    return YCbCr_data;
+}
+
+std::vector<std::vector<dYCbCr>> image_to_YCbCr(PPM &image) {
+    if (image.channel == 1) {
+        return gray_to_YCbCr(image);
+    }
+
+    std::vector<std::vector<RGB>> RGB_data = PPM_data_to_vector(image);
+    return RGB_to_YCbCr(RGB_data);
+}
+
+dYCbCr pixel_to_YCbCr(RGB &pixel) {
+    return dYCbCr {
+        0.257 * pixel.r + 0.564 * pixel.g + 0.098 * pixel.b + 16.0,
+        -0.148 * pixel.r - 0.291 * pixel.g + 0.439 * pixel.b + 128.0,
+        0.439 * pixel.r - 0.368 * pixel.g - 0.071 * pixel.b + 128.0
+    };
+}
+
 std::vector<std::vector<dYCbCr>> RGB_to_YCbCr(std::vector<std::vector<RGB>> &RGB_data) {
+    TRACE_ZONE("RGB_to_YCbCr");
+
     std::vector<std::vector<dYCbCr>> YCbCr_data(std::vector(RGB_data.size(), std::vector(RGB_data[0].size(), dYCbCr {0.0, 0.0, 0.0})));
 
     for (int i = 0; i < RGB_data.size(); i++) {
         for (int j = 0; j < RGB_data[0].size(); j++) {
-            YCbCr_data[i][j].y = 0.257 * RGB_data[i][j].r + 0.564 * RGB_data[i][j].g + 0.098 * RGB_data[i][j].b + 16.0;
-            YCbCr_data[i][j].cb = -0.148 * RGB_data[i][j].r - 0.291 * RGB_data[i][j].g + 0.439 * RGB_data[i][j].b + 128.0;
-            YCbCr_data[i][j].cr = 0.439 * RGB_data[i][j].r - 0.368 * RGB_data[i][j].g - 0.071 * RGB_data[i][j].b + 128.0;
+            YCbCr_data[i][j] = pixel_to_YCbCr(RGB_data[i][j]);
         }
     }
 
@@ -143,7 +220,7 @@ int around(double value) {
     return value >= 0.0 ? int(value + 0.5) : int (value - 0.5);
 }
 
-std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block) {
+std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel) {
     std::vector<iYCbCr> block_DCT_data(block * block, iYCbCr {0, 0, 0});
     std::vector<dYCbCr> tmp_block_DCT_data(block * block, dYCbCr {0.0, 0.0, 0.0});
 
@@ -154,6 +231,9 @@ std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int
 
             for (int n = 0; n < block; n++) {
                 tmp.y += (YCbCr_data[m + row][n + col].y - 128.0) * std::cos((2.0 * n + 1.0) * l * M_PI / (2.0 * block));
+                if (n_channel == 1) {
+                    continue;
+                }
                 tmp.cb += (YCbCr_data[m + row][n + col].cb - 128.0) * std::cos((2.0 * n + 1.0) * l * M_PI / (2.0 * block));
                 tmp.cr += (YCbCr_data[m + row][n + col].cr - 128.0) * std::cos((2.0 * n + 1.0) * l * M_PI / (2.0 * block));
             }
@@ -171,6 +251,9 @@ std::vector<iYCbCr> do_2d_DCT(std::vector<std::vector<dYCbCr>> &YCbCr_data, int
 
             for (int m = 0; m < block; m++) {
                 tmp.y += tmp_block_DCT_data[m * block + l].y * std::cos((2.0 * m + 1.0) * k * M_PI / (2.0 * block));
+                if (n_channel == 1) {
+                    continue;
+                }
                 tmp.cb += tmp_block_DCT_data[m * block + l].cb * std::cos((2.0 * m + 1.0) * k * M_PI / (2.0 * block));
                 tmp.cr += tmp_block_DCT_data[m * block + l].cr * std::cos((2.0 * m + 1.0) * k * M_PI / (2.0 * block));
             }
@@ -247,6 +330,136 @@ std::vector<iYCbCr> quantize(std::vector<iYCbCr> block_data, std::vector<int> &q
     return block_quan_data;
 }
 
+int get_RDO_code_bits(const std::map<int, HuffmanInfo> &table, int symbol) {
+    // symbols without a code must never be chosen
+    auto it = table.find(symbol);
+    return it == table.end() ? (1 << 20) : it->second.n_bits;
+}
+
+int get_RDO_bits(const std::map<int, HuffmanInfo> &table, int run, int len) {
+    // long runs are coded as ZRL symbols first, like write_data_section does
+    return (run / 16) * get_RDO_code_bits(table, 0xF0) + get_RDO_code_bits(table, ((run % 16) << 4) + len) + len;
+}
+
+int get_RDO_tail_bits(const std::map<int, HuffmanInfo> &table, int tail) {
+    // every 16 trailing zeros take a ZRL, the rest an EOB
+    return (tail / 16) * get_RDO_code_bits(table, 0xF0) + (tail % 16 != 0 ? get_RDO_code_bits(table, 0x00) : 0);
+}
+
+void quantize_RDO_channel(std::vector<double> &coef, std::vector<int> &quan, std::vector<int> &out, std::map<int, HuffmanInfo> &table, RDOSetting &setting) {
+    // coef, quan and out are in zigzag order
+    const int n = coef.size();
+    const int window = 4;
+
+    out.assign(n, 0);
+    out[0] = around(coef[0] / quan[0]);
+
+    // distortion of zeroing coef[1..k]
+    std::vector<double> zero_dist(n, 0.0);
+    for (int k = 1; k < n; k++) {
+        zero_dist[k] = zero_dist[k - 1] + coef[k] * coef[k];
+    }
+
+    // positions which may stay nonzero, 0 is the start state
+    std::vector<int> pos = {0};
+    for (int k = 1; k < n; k++) {
+        if (around(coef[k] / quan[k]) != 0) {
+            pos.push_back(k);
+        }
+    }
+
+    std::vector<double> best(pos.size(), 0.0);
+    std::vector<int> prev(pos.size(), 0);
+    std::vector<int> value(pos.size(), 0);
+
+    for (int p = 1; p < pos.size(); p++) {
+        int k = pos[p];
+        int v = around(coef[k] / quan[k]);
+
+        std::vector<int> candidates = {v};
+        if (!setting.fast && std::abs(v) > 1) {
+            candidates.push_back(v > 0 ? v - 1 : v + 1);
+        }
+
+        best[p] = 1e300;
+        int first = setting.fast ? std::max(0, p - window) : 0;
+        for (int a: candidates) {
+            double dist = (coef[k] - a * quan[k]) * (coef[k] - a * quan[k]);
+            int len = get_VLI(a);
+
+            for (int q = first; q < p; q++) {
+                int i = pos[q];
+                double cost = best[q] + (zero_dist[k - 1] - zero_dist[i]) + dist
+                    + setting.lambda * get_RDO_bits(table, k - 1 - i, len);
+
+                if (cost < best[p]) {
+                    best[p] = cost;
+                    prev[p] = q;
+                    value[p] = a;
+                }
+            }
+        }
+    }
+
+    // end of block, trailing zeros as ZRL + EOB like write_data_section
+    int last = 0;
+    double best_total = 1e300;
+    for (int p = 0; p < pos.size(); p++) {
+        double cost = best[p] + (zero_dist[n - 1] - zero_dist[pos[p]])
+            + setting.lambda * get_RDO_tail_bits(table, n - 1 - pos[p]);
+
+        if (cost < best_total) {
+            best_total = cost;
+            last = p;
+        }
+    }
+
+    for (int p = last; p > 0; p = prev[p]) {
+        out[pos[p]] = value[p];
+    }
+}
+
+std::vector<iYCbCr> quantize_RDO(std::vector<iYCbCr> block_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, RDOSetting &setting, int n_channel) {
+    std::vector<iYCbCr> block_quan_data(block_data.size(), iYCbCr {0, 0, 0});
+
+    static const std::vector<std::vector<int>> order_8 = get_zigzag_order(8);
+
+    int block = std::sqrt(block_data.size());
+    std::vector<std::vector<int>> order = block == 8 ? order_8 : get_zigzag_order(block);
+
+    std::vector<double> coef(order.size());
+    std::vector<int> quan(order.size());
+    std::vector<int> out;
+
+    for (int channel = 0; channel < n_channel; channel++) {
+        std::vector<int> &table_quan = channel == 0 ? quan_lum : quan_chrom;
+        std::map<int, HuffmanInfo> &table = channel == 0 ? *setting.huffman_lum_ac : *setting.huffman_chrom_ac;
+
+        for (int i = 0; i < order.size(); i++) {
+            int index = order[i][0] * block + order[i][1];
+            coef[i] = (channel == 0) ? block_data[index].y
+                : (channel == 1) ? block_data[index].cb
+                : block_data[index].cr;
+            quan[i] = table_quan[index];
+        }
+
+        quantize_RDO_channel(coef, quan, out, table, setting);
+
+        for (int i = 0; i < order.size(); i++) {
+            int index = order[i][0] * block + order[i][1];
+            if (channel == 0) {
+                block_quan_data[index].y = out[i];
+            } else if (channel == 1) {
+                block_quan_data[index].cb = out[i];
+            } else {
+                block_quan_data[index].cr = out[i];
+            }
+        }
+    }
+
+    return block_quan_data;
+}
+
 std::vector<std::vector<int>> get_zigzag_order(int block) {
     static const int d[2][2] = {{1, -1}, {-1, 1}};
     static const int corner[2][4] = {{1, 0, 0, 1}, {0, 1, 1, 0}};
@@ -283,8 +496,10 @@ std::vector<std::vector<int>> get_zigzag_order(int block) {
 std::vector<iYCbCr> zigzag(std::vector<iYCbCr> block_data) {
     std::vector<iYCbCr> block_zigzag_data(block_data.size(), iYCbCr {0, 0, 0});
 
+    static const std::vector<std::vector<int>> order_8 = get_zigzag_order(8);
+
     int block = std::sqrt(block_data.size());
-    std::vector<std::vector<int>> order = get_zigzag_order(block);
+    std::vector<std::vector<int>> order = block == 8 ? order_8 : get_zigzag_order(block);
 
     for (int i = 0; i < order.size(); i++) {
         block_zigzag_data[i].y = block_data[order[i][0] * block + order[i][1]].y;
@@ -295,27 +510,35 @@ std::vector<iYCbCr> zigzag(std::vector<iYCbCr> block_data) {
     return block_zigzag_data;
 }
 
-std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> get_statistics_before_quantize(std::vector<std::vector<dYCbCr>> &YCbCr_data) {
+std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> get_statistics_before_quantize(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> *sample_blocks, int n_channel) {
+    TRACE_ZONE("get_statistics_before_quantize");
+
     const int block = 8;
 
     int height = YCbCr_data.size();
     int width = YCbCr_data[0].size();
     int block_num = (height / block) * (width / block);
+    int sample_num = sample_blocks ? sample_blocks->size() : block_num;
 
     std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> statistics_data = {
         std::vector<std::vector<int>>(block * block, std::vector<int>(0)),
         std::vector<std::vector<int>>(block * block, std::vector<int>(0))
     };
 
-    for (int i = 0; i < block_num; i++) {
+    for (int k = 0; k < sample_num; k++) {
+        int i = sample_blocks ? (*sample_blocks)[k] : k;
         int col = i % (width / block) * block;
         int row = i / (width / block) * block;
 
-        // dct
-        std::vector<iYCbCr> block_DCT_data = do_2d_DCT(YCbCr_data, row, col, block);
-        
+        // dct, closed form for constant blocks
+        std::vector<iYCbCr> block_DCT_data = is_uniform_block(YCbCr_data, row, col, block, n_channel) ? get_uniform_DCT(YCbCr_data[row][col], block, n_channel)
+            : do_2d_DCT(YCbCr_data, row, col, block, n_channel);
+
         for (int j = 0; j < block_DCT_data.size(); j++) {
             statistics_data.first[j].push_back(block_DCT_data[j].y);
+            if (n_channel == 1) {
+                continue;
+            }
             statistics_data.second[j].push_back(block_DCT_data[j].cb);
             statistics_data.second[j].push_back(block_DCT_data[j].cr);
         }
@@ -324,37 +547,254 @@ std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> get_stat
     return statistics_data;
 }
 
-std::vector<std::vector<iYCbCr>> do_partition_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> &quan_lum=quan_lum, std::vector<int> &quan_chrom=quan_chrom) {
+thread_local EncodeControl *current_control = nullptr;
+
+EncodeControl *get_encode_control() {
+    return current_control;
+}
+
+EncodeControl *set_encode_control(EncodeControl *control) {
+    EncodeControl *previous = current_control;
+    current_control = control;
+    return previous;
+}
+
+bool is_encode_cancelled(EncodeControl *control) {
+    if (!control) {
+        return false;
+    }
+    if (!control->cancelled && std::chrono::steady_clock::now() >= control->deadline) {
+        control->cancelled = true;
+    }
+    return control->cancelled;
+}
+
+std::vector<iYCbCr> do_quantize_process(std::vector<iYCbCr> &block_DCT_data, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, int n_channel, RDOSetting *rdo) {
+    // quantize
+    std::vector<iYCbCr> block_quan_data = rdo ? quantize_RDO(block_DCT_data, quan_lum, quan_chrom, *rdo, n_channel)
+        : quantize(block_DCT_data, quan_lum, quan_chrom);
+
+    // zig zag
+    return zigzag(block_quan_data);
+}
+
+std::vector<iYCbCr> do_block_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, std::vector<int> &quan_lum, std::vector<int> &quan_chrom, int n_channel, RDOSetting *rdo, std::vector<iYCbCr> *DCT_data) {
     const int block = 8;
 
+    // dct
+    std::vector<iYCbCr> block_DCT_data = do_2d_DCT(YCbCr_data, row, col, block, n_channel);
+    if (DCT_data) {
+        *DCT_data = block_DCT_data;
+    }
+
+    return do_quantize_process(block_DCT_data, quan_lum, quan_chrom, n_channel, rdo);
+}
+
+// uniform and duplicate blocks
+std::atomic<long long> block_cache_block_num(0);
+std::atomic<long long> block_cache_uniform_num(0);
+std::atomic<long long> block_cache_duplicate_num(0);
+
+bool is_uniform_block(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel) {
+    dYCbCr &first = YCbCr_data[row][col];
+
+    for (int m = row; m < row + block; m++) {
+        for (int n = col; n < col + block; n++) {
+            dYCbCr &pixel = YCbCr_data[m][n];
+            if (pixel.y != first.y || (n_channel != 1 && (pixel.cb != first.cb || pixel.cr != first.cr))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<iYCbCr> get_uniform_DCT(dYCbCr &pixel, int block, int n_channel) {
+    // do_2d_DCT with cos(0) = 1 and the same summation order, so the DC matches bit for bit,
+    // the AC terms are rounding noise far below 0.5
+    std::vector<iYCbCr> block_DCT_data(block * block, iYCbCr {0, 0, 0});
+    double alpha = std::sqrt(1.0 / block);
+    dYCbCr row_sum = {0.0, 0.0, 0.0};
+    dYCbCr col_sum = {0.0, 0.0, 0.0};
+
+    for (int n = 0; n < block; n++) {
+        row_sum.y += pixel.y - 128.0;
+        row_sum.cb += pixel.cb - 128.0;
+        row_sum.cr += pixel.cr - 128.0;
+    }
+    for (int m = 0; m < block; m++) {
+        col_sum.y += alpha * row_sum.y;
+        col_sum.cb += alpha * row_sum.cb;
+        col_sum.cr += alpha * row_sum.cr;
+    }
+
+    block_DCT_data[0].y = around(alpha * col_sum.y);
+    if (n_channel != 1) {
+        block_DCT_data[0].cb = around(alpha * col_sum.cb);
+        block_DCT_data[0].cr = around(alpha * col_sum.cr);
+    }
+    return block_DCT_data;
+}
+
+unsigned long long get_block_hash(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int block, int n_channel) {
+    // FNV-1a over the bit patterns of the samples
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](double value) {
+        unsigned long long bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        hash = (hash ^ bits) * 0x100000001b3ULL;
+    };
+
+    for (int m = row; m < row + block; m++) {
+        for (int n = col; n < col + block; n++) {
+            add(YCbCr_data[m][n].y);
+            if (n_channel != 1) {
+                add(YCbCr_data[m][n].cb);
+                add(YCbCr_data[m][n].cr);
+            }
+        }
+    }
+    return hash ^ (hash >> 29);
+}
+
+bool is_same_block(std::vector<std::vector<dYCbCr>> &YCbCr_data, int row, int col, int other_row, int other_col, int block, int n_channel) {
+    for (int m = 0; m < block; m++) {
+        for (int n = 0; n < block; n++) {
+            dYCbCr &pixel = YCbCr_data[row + m][col + n];
+            dYCbCr &other = YCbCr_data[other_row + m][other_col + n];
+            if (pixel.y != other.y || (n_channel != 1 && (pixel.cb != other.cb || pixel.cr != other.cr))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+BlockCacheStats get_block_cache_stats() {
+    return BlockCacheStats {block_cache_block_num, block_cache_uniform_num, block_cache_duplicate_num};
+}
+
+std::vector<std::vector<iYCbCr>> do_partition_process(std::vector<std::vector<dYCbCr>> &YCbCr_data, std::vector<int> &quan_lum=quan_lum, std::vector<int> &quan_chrom=quan_chrom, int n_channel, RDOSetting *rdo, std::vector<std::vector<iYCbCr>> *DCT_blocks, EncodeControl *control) {
+    const int block = 8;
+    const int cache_size = 1024;
+
     int height = YCbCr_data.size();
     int width = YCbCr_data[0].size();
     int block_num = (height / block) * (width / block);
     std::vector<std::vector<iYCbCr>> blocks_data(std::vector(block_num, std::vector(block * block, iYCbCr {0, 0, 0})));
+    if (DCT_blocks) {
+        DCT_blocks->resize(block_num);
+    }
 
-    for (int i = 0; i < block_num; i++) {
-        int col = i % (width / block) * block;
-        int row = i / (width / block) * block;
+    // direct-mapped, index of the last block with that hash
+    std::vector<int> cache(cache_size, -1);
+    long long uniform_num = 0;
+    long long duplicate_num = 0;
+
+    // one tile per MCU row
+    int block_cols = width / block;
+    for (int tile = 0; tile < height / block; tile++) {
+        TRACE_ZONE_ARG("do_partition_process tile", tile);
 
-        // dct
-        std::vector<iYCbCr> block_DCT_data = do_2d_DCT(YCbCr_data, row, col, block);
+        // a cancelled encode leaves the remaining blocks zero
+        if (is_encode_cancelled(control)) {
+            break;
+        }
 
-        // quantize
-        std::vector<iYCbCr> block_quan_data = quantize(block_DCT_data, quan_lum, quan_chrom);
+        for (int i = tile * block_cols; i < (tile + 1) * block_cols; i++) {
+            int col = i % block_cols * block;
+            int row = i / block_cols * block;
+            std::vector<iYCbCr> *DCT_data = DCT_blocks ? &(*DCT_blocks)[i] : nullptr;
 
-        // zig zag
-        std::vector<iYCbCr> block_zigzag_data = zigzag(block_quan_data);
+            // constant blocks skip the transform
+            if (is_uniform_block(YCbCr_data, row, col, block, n_channel)) {
+                std::vector<iYCbCr> block_DCT_data = get_uniform_DCT(YCbCr_data[row][col], block, n_channel);
+                if (DCT_data) {
+                    *DCT_data = block_DCT_data;
+                }
+                blocks_data[i] = do_quantize_process(block_DCT_data, quan_lum, quan_chrom, n_channel, rdo);
+                uniform_num++;
+                continue;
+            }
 
-        for (int j = 0; j < block * block; j++) {
-            blocks_data[i][j].y = block_zigzag_data[j].y;
-            blocks_data[i][j].cb = block_zigzag_data[j].cb;
-            blocks_data[i][j].cr = block_zigzag_data[j].cr;
+            // a block seen earlier in this pass reuses its coefficients
+            int &entry = cache[get_block_hash(YCbCr_data, row, col, block, n_channel) % cache_size];
+            if (entry >= 0 && is_same_block(YCbCr_data, row, col, entry / block_cols * block, entry % block_cols * block, block, n_channel)) {
+                blocks_data[i] = blocks_data[entry];
+                if (DCT_data) {
+                    *DCT_data = (*DCT_blocks)[entry];
+                }
+                duplicate_num++;
+                continue;
+            }
+
+            entry = i;
+            blocks_data[i] = do_block_process(YCbCr_data, row, col, quan_lum, quan_chrom, n_channel, rdo, DCT_data);
+        }
+
+        if (control && control->progress) {
+            control->progress(tile + 1, height / block);
         }
     }
 
+    block_cache_block_num += block_num;
+    block_cache_uniform_num += uniform_num;
+    block_cache_duplicate_num += duplicate_num;
+
     return blocks_data;
 }
 
+// sampled statistics
+std::vector<int> get_sample_blocks(int block_rows, int block_cols, SampleSetting &setting) {
+    std::vector<int> sample_blocks;
+    // an image under one block has nothing to sample, callers keep the standard tables
+    if (block_rows <= 0 || block_cols <= 0) {
+        return sample_blocks;
+    }
+    std::vector<char> picked(block_rows * block_cols, 0);
+
+    // every row_step-th MCU row, centered in its stratum, a step below 1 takes every row
+    int row_step = std::max(1, setting.row_step);
+    for (int row = std::min(row_step / 2, block_rows - 1); row < block_rows; row += row_step) {
+        for (int col = 0; col < block_cols; col++) {
+            picked[row * block_cols + col] = 1;
+        }
+    }
+
+    // plus random blocks over the whole image, picks on sampled rows are no-ops
+    std::mt19937 rng(setting.seed);
+    std::uniform_int_distribution<int> dist(0, block_rows * block_cols - 1);
+    for (int i = 0; i < setting.random_num; i++) {
+        picked[dist(rng)] = 1;
+    }
+
+    for (int i = 0; i < picked.size(); i++) {
+        if (picked[i]) {
+            sample_blocks.push_back(i);
+        }
+    }
+
+    return sample_blocks;
+}
+
+void add_fallback_frequency(std::vector<int> &freq, int is_ac) {
+    // every symbol the encoder may emit needs a code even if the sample missed it
+    if (!is_ac) {
+        for (int len = 0; len <= 11; len++) {
+            freq[len] = std::max(freq[len], 1);
+        }
+        return;
+    }
+
+    freq[0x00] = std::max(freq[0x00], 1);
+    freq[0xF0] = std::max(freq[0xF0], 1);
+    for (int run = 0; run < 16; run++) {
+        for (int len = 1; len <= 10; len++) {
+            freq[(run << 4) + len] = std::max(freq[(run << 4) + len], 1);
+        }
+    }
+}
+
 // bit vector
 void BitVector::add_bit(unsigned char b) {
     data[data.size() - 1] |= b << space;
@@ -376,6 +816,18 @@ void BitVector::add_bits(int value, int length) {
     }
 }
 
+void BitVector::add_bit_vector(BitVector &other) {
+    // splice at bit granularity, whole bytes are shifted into place
+    int used = 7 - space;
+    for (int i = 0; i + 1 < other.data.size(); i++) {
+        data[data.size() - 1] |= other.data[i] >> used;
+        data.push_back((other.data[i] << (8 - used)) & 0xFF);
+    }
+
+    int rest = 7 - other.space;
+    add_bits(other.data[other.data.size() - 1] >> (8 - rest), rest);
+}
+
 void BitVector::print_binary() {
     for (int i = 0; i < data.size(); i++) {
         std::cout << "0b";
@@ -396,7 +848,7 @@ void BitVector::print_binary() {
     }
 }
 
-void BitVector::write_binary(std::ofstream &file) {
+void BitVector::write_binary(std::ostream &file) {
     for (int i = 0; i < data.size(); i++) {
         file.put(data[i]);
         if (data[i] == 0xFF) {
@@ -458,13 +910,62 @@ std::map<int, HuffmanInfo> preprocess_DHT(const std::vector<int> &table) {
     return DHT_info;
 }
 
-void write_SOI_section(std::ofstream &file) {
+const HuffmanInfo &get_huffman_info(const std::map<int, HuffmanInfo> &table, int symbol) {
+    // read only, the tables are shared between threads
+    auto it = table.find(symbol);
+    assert(it != table.end());
+    return it->second;
+}
+
+std::map<int, HuffmanInfo> *get_standard_DHT_info(const std::vector<int> &table) {
+    // preprocessed once, the standard tables are never modified
+    static std::map<int, HuffmanInfo> info_lum_ac = preprocess_DHT(::huffman_lum_ac);
+    static std::map<int, HuffmanInfo> info_lum_dc = preprocess_DHT(::huffman_lum_dc);
+    static std::map<int, HuffmanInfo> info_chrom_ac = preprocess_DHT(::huffman_chrom_ac);
+    static std::map<int, HuffmanInfo> info_chrom_dc = preprocess_DHT(::huffman_chrom_dc);
+
+    if (&table == &::huffman_lum_ac) {
+        return &info_lum_ac;
+    } else if (&table == &::huffman_lum_dc) {
+        return &info_lum_dc;
+    } else if (&table == &::huffman_chrom_ac) {
+        return &info_chrom_ac;
+    } else if (&table == &::huffman_chrom_dc) {
+        return &info_chrom_dc;
+    }
+    return nullptr;
+}
+
+void warm_encoder_tables() {
+    // builds the function-local statics of the encoder on the calling thread,
+    // so none of them is first allocated inside an arena scope
+    std::vector<iYCbCr> block_data(64, iYCbCr {0, 0, 0});
+    std::vector<std::vector<int>> data(64, std::vector<int>(1, 0));
+    RDOSetting setting = {1.0, 1, get_standard_DHT_info(::huffman_lum_ac), get_standard_DHT_info(::huffman_chrom_ac)};
+
+    get_standard_DHT_info(::huffman_lum_dc);
+    get_standard_DHT_info(::huffman_chrom_dc);
+    zigzag(block_data);
+    quantize_RDO(block_data, quan_lum, quan_chrom, setting);
+    get_adjusted_quantize_table(data, 1.0, 1);
+    get_adjusted_quantize_table(data, 1.0, 0);
+#ifdef JPEG_TRACE
+    get_trace_buffer();
+    get_trace_time();
+#endif
+}
+
+void write_SOI_section(std::ostream &file) {
+    TRACE_ZONE("write_SOI_section");
+
     file.put(0xFF);
     file.put(0xD8);
 }
 
-void write_SOF0_section(std::ofstream &file, int height, int width) {
-    int SOF0_len = 2 + 1 + 2 + 2 + 1 + 3 * 3;
+void write_SOF0_section(std::ostream &file, int height, int width, int n_channel) {
+    TRACE_ZONE("write_SOF0_section");
+
+    int SOF0_len = 2 + 1 + 2 + 2 + 1 + n_channel * 3;
     file.put(0xFF);
     file.put(0xC0);
     file.put(SOF0_len >> 8);
@@ -474,14 +975,19 @@ void write_SOF0_section(std::ofstream &file, int height, int width) {
     file.put(height >> 0);
     file.put(width >> 8);
     file.put(width >> 0);
-    file.put(0x03);
+    file.put(n_channel);
 
     file.put(0x01); file.put(0x11); file.put(0x00);
+    if (n_channel == 1) {
+        return;
+    }
     file.put(0x02); file.put(0x11); file.put(0x01);
     file.put(0x03); file.put(0x11); file.put(0x01);
 }
 
-void write_DQT_section(std::ofstream &file, int num, const std::vector<int> &table) {
+void write_DQT_section(std::ostream &file, int num, const std::vector<int> &table) {
+    TRACE_ZONE("write_DQT_section");
+
     int DQT_len = 2 + 1 + 64;
 
     file.put(0xFF);
@@ -499,7 +1005,9 @@ void write_DQT_section(std::ofstream &file, int num, const std::vector<int> &tab
     }
 }
 
-void write_huffman_section(std::ofstream &file, int num, const std::vector<int> &table) {
+void write_huffman_section(std::ostream &file, int num, const std::vector<int> &table) {
+    TRACE_ZONE("write_huffman_section");
+
     int HT_len = 16 + 2 + 1;
     for (int i = 0; i < 16; i++) {
         HT_len += table[i];
@@ -518,117 +1026,237 @@ void write_huffman_section(std::ofstream &file, int num, const std::vector<int>
     }
 }
 
-void write_SOS_section(std::ofstream &file) {
-    int SOS_len = 2 + 1 + 2 * 3 + 3;
+void write_SOS_section(std::ostream &file, int n_channel) {
+    TRACE_ZONE("write_SOS_section");
+
+    int SOS_len = 2 + 1 + 2 * n_channel + 3;
 
     file.put(0xFF);
     file.put(0xDA);
     file.put(SOS_len >> 8);
     file.put(SOS_len >> 0);
-    file.put(0x03);
+    file.put(n_channel);
 
     file.put(0x01); file.put(0x00);
-    file.put(0x02); file.put(0x11);
-    file.put(0x03); file.put(0x11);
+    if (n_channel == 3) {
+        file.put(0x02); file.put(0x11);
+        file.put(0x03); file.put(0x11);
+    }
 
     file.put(0x00); 
     file.put(0x3F);
     file.put(0x00); 
 }
 
-void write_data_section(
-    std::ofstream &file, std::vector<std::vector<iYCbCr>> &blocks_data,
+void write_DRI_section(std::ostream &file, int restart_interval) {
+    TRACE_ZONE("write_DRI_section");
+
+    file.put(0xFF);
+    file.put(0xDD);
+    file.put(0x00);
+    file.put(0x04);
+    file.put(restart_interval >> 8);
+    file.put(restart_interval >> 0);
+}
+
+uint64_t get_nonzero_mask(const std::vector<int> &block) {
+    // bit j set for every nonzero AC coefficient, the DC bit is always clear
+    uint64_t mask = 0;
+#ifdef __SSE2__
+    if (block.size() == 64) {
+        // 16 coefficients at a time, saturating packs keep nonzero values nonzero
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i *data = (const __m128i *)block.data();
+        for (int j = 0; j < 16; j += 4) {
+            __m128i low = _mm_packs_epi32(_mm_loadu_si128(data + j), _mm_loadu_si128(data + j + 1));
+            __m128i high = _mm_packs_epi32(_mm_loadu_si128(data + j + 2), _mm_loadu_si128(data + j + 3));
+            int zero_bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_packs_epi16(low, high), zero));
+            mask |= (uint64_t)(~zero_bits & 0xFFFF) << (j * 4);
+        }
+        return mask & ~(uint64_t)1;
+    }
+#endif
+    for (int j = 1; j < block.size(); j++) {
+        mask |= (uint64_t)(block[j] != 0) << j;
+    }
+    return mask;
+}
+
+void encode_block(
+    std::vector<int> &block, int dc_value,
+    int get_statistics,
+    void *huffman_ac,
+    void *huffman_dc,
+    BitVector &bit_data
+) {
+    // block is in zigzag order, dc_value is the difference to the predictor
+    // DC
+    int len = get_VLI(dc_value);
+    if (!get_statistics) {
+        const HuffmanInfo &info = get_huffman_info(*(const std::map<int, HuffmanInfo> *)huffman_dc, len);
+        to_binary_str(info.code, info.n_bits, bit_data);
+        to_binary_str(dc_value, len, bit_data);
+    } else {
+        (*(std::vector<int> *)huffman_dc)[len]++;
+    }
+
+    // AC
+    auto put_ac = [&](int symbol) {
+        if (!get_statistics) {
+            const HuffmanInfo &info = get_huffman_info(*(const std::map<int, HuffmanInfo> *)huffman_ac, symbol);
+            to_binary_str(info.code, info.n_bits, bit_data);
+        } else {
+            (*(std::vector<int> *)huffman_ac)[symbol]++;
+        }
+    };
+
+    uint64_t mask = get_nonzero_mask(block);
+
+    // jump from nonzero to nonzero, a ZRL for every 16 zeros on the way
+    int last = 0;
+    while (mask) {
+        int j = __builtin_ctzll(mask);
+        mask &= mask - 1;
+
+        int zero_cnt = j - last - 1;
+        for (; zero_cnt >= 16; zero_cnt -= 16) {
+            put_ac(0xF0);
+        }
+
+        int ac_value = block[j];
+        int len = get_VLI(ac_value);
+        put_ac((zero_cnt << 4) + len);
+        if (!get_statistics) {
+            to_binary_str(ac_value, len, bit_data);
+        }
+
+        last = j;
+    }
+
+    // trailing zeros are still counted in runs of 16, EOB only for the rest
+    int zero_cnt = block.size() - 1 - last;
+    for (; zero_cnt >= 16; zero_cnt -= 16) {
+        put_ac(0xF0);
+    }
+    if (zero_cnt != 0) {
+        put_ac(0x00);
+    }
+}
+
+void encode_block_range(
+    std::vector<std::vector<iYCbCr>> &blocks_data, int begin, int end,
     int get_statistics,
     void *huffman_lum_ac,
     void *huffman_lum_dc,
     void *huffman_chrom_ac,
-    void *huffman_chrom_dc
+    void *huffman_chrom_dc,
+    std::vector<int> *sample_blocks,
+    int n_channel,
+    BitVector &bit_data
 ) {
-    BitVector bit_data;
-
-    for (int i = 0; i < blocks_data.size(); i++) {
-        for (int channel = 0; channel < 3; channel++) {
-            // DC
-            int dc_value;
-            if (i == 0) {
-                dc_value = (channel == 0) ? blocks_data[i][0].y
-                    : (channel == 1) ? blocks_data[i][0].cb
-                    : blocks_data[i][0].cr;
-            } else {
-                dc_value = (channel == 0) ? blocks_data[i][0].y - blocks_data[i - 1][0].y
-                    : (channel == 1) ? blocks_data[i][0].cb - blocks_data[i - 1][0].cb
-                    : blocks_data[i][0].cr - blocks_data[i - 1][0].cr;
-            }
+    TRACE_ZONE_ARG(get_statistics ? "histogram slice" : "entropy slice", begin);
 
-            int len = get_VLI(dc_value);
-            if (!get_statistics) {
-                HuffmanInfo info = (channel == 0) ? (*(std::map<int, HuffmanInfo> *)huffman_lum_dc)[len] : (*(std::map<int, HuffmanInfo> *)huffman_chrom_dc)[len];
-                to_binary_str(info.code, info.n_bits, bit_data);
-                to_binary_str(dc_value, len, bit_data);
-            } else {
-                if (channel == 0) {
-                    (*(std::vector<int> *)huffman_lum_dc)[len]++;
-                } else {
-                    (*(std::vector<int> *)huffman_chrom_dc)[len]++;
-                }
-            }
+    std::vector<int> block(blocks_data.empty() ? 0 : blocks_data[0].size());
 
-            // AC
-            int zero_cnt = 0;
-            for (int j = 1; j < blocks_data[0].size(); j++) {
-                int ac_value = (channel == 0) ? blocks_data[i][j].y
+    for (int k = begin; k < end; k++) {
+        int i = sample_blocks ? (*sample_blocks)[k] : k;
+        for (int channel = 0; channel < n_channel; channel++) {
+            for (int j = 0; j < block.size(); j++) {
+                block[j] = (channel == 0) ? blocks_data[i][j].y
                     : (channel == 1) ? blocks_data[i][j].cb
                     : blocks_data[i][j].cr;
-
-                if (ac_value == 0) {
-                    zero_cnt++;
-                    if (zero_cnt == 16) {
-                        if (!get_statistics) {
-                            HuffmanInfo info = (channel == 0) ? (*(std::map<int, HuffmanInfo> *)huffman_lum_ac)[0xF0] : (*(std::map<int, HuffmanInfo> *)huffman_chrom_ac)[0xF0];
-                            to_binary_str(info.code, info.n_bits, bit_data);
-                        } else {
-                            if (channel == 0) {
-                                (*(std::vector<int> *)huffman_lum_ac)[0xF0]++;
-                            } else {
-                                (*(std::vector<int> *)huffman_chrom_ac)[0xF0]++;
-                            }
-                        }
-
-                        zero_cnt = 0;
-                    }
-                } else {
-                    int len = get_VLI(ac_value);
-                    int merge_num = (zero_cnt << 4) + len;
-
-                    if (!get_statistics) {
-                        HuffmanInfo info = (channel == 0) ? (*(std::map<int, HuffmanInfo> *)huffman_lum_ac)[merge_num] : (*(std::map<int, HuffmanInfo> *)huffman_chrom_ac)[merge_num];
-                        to_binary_str(info.code, info.n_bits, bit_data);
-                        to_binary_str(ac_value, len, bit_data);
-                    } else {
-                        if (channel == 0) {
-                            (*(std::vector<int> *)huffman_lum_ac)[merge_num]++;
-                        } else {
-                            (*(std::vector<int> *)huffman_chrom_ac)[merge_num]++;
-                        }
-                    }
-
-                    zero_cnt = 0;
-                }
             }
 
-            if (zero_cnt != 0) {
-                if (!get_statistics) {
-                    HuffmanInfo info = (channel == 0) ? (*(std::map<int, HuffmanInfo> *)huffman_lum_ac)[0x00] : (*(std::map<int, HuffmanInfo> *)huffman_chrom_ac)[0x00];
-                    to_binary_str(info.code, info.n_bits, bit_data);
-                } else {
-                    if (channel == 0) {
-                        (*(std::vector<int> *)huffman_lum_ac)[0x00]++;
-                    } else {
-                        (*(std::vector<int> *)huffman_chrom_ac)[0x00]++;
-                    }
-                }
+            // the predictor of the first block of a range is the last DC of the previous one
+            int dc_value = block[0];
+            if (i != 0) {
+                dc_value -= (channel == 0) ? blocks_data[i - 1][0].y
+                    : (channel == 1) ? blocks_data[i - 1][0].cb
+                    : blocks_data[i - 1][0].cr;
             }
-                
+
+            encode_block(
+                block, dc_value,
+                get_statistics,
+                (channel == 0) ? huffman_lum_ac : huffman_chrom_ac,
+                (channel == 0) ? huffman_lum_dc : huffman_chrom_dc,
+                bit_data
+            );
+        }
+    }
+}
+
+thread_local int entropy_thread_num = 0;
+
+int set_entropy_thread_num(int n_thread) {
+    int previous = entropy_thread_num;
+    entropy_thread_num = n_thread;
+    return previous;
+}
+
+int get_entropy_thread_num(int block_num) {
+    // at least 1024 blocks per slice, the splice is not worth it below
+    const int min_slice = 1024;
+
+    int n_thread = entropy_thread_num > 0 ? entropy_thread_num : std::thread::hardware_concurrency();
+    return std::max(1, std::min(n_thread, block_num / min_slice));
+}
+
+void write_data_section(
+    std::ostream &file, std::vector<std::vector<iYCbCr>> &blocks_data,
+    int get_statistics,
+    void *huffman_lum_ac,
+    void *huffman_lum_dc,
+    void *huffman_chrom_ac,
+    void *huffman_chrom_dc,
+    std::vector<int> *sample_blocks,
+    int n_channel,
+    int n_thread
+) {
+    TRACE_ZONE(get_statistics ? "histogram" : "write_data_section");
+
+    BitVector bit_data;
+    int block_num = sample_blocks ? sample_blocks->size() : blocks_data.size();
+
+    // statistics are accumulated into shared counters, keep them serial
+    if (get_statistics || n_thread <= 1 || block_num < n_thread) {
+        encode_block_range(
+            blocks_data, 0, block_num,
+            get_statistics,
+            huffman_lum_ac,
+            huffman_lum_dc,
+            huffman_chrom_ac,
+            huffman_chrom_dc,
+            sample_blocks,
+            n_channel,
+            bit_data
+        );
+    } else {
+        // every thread encodes a contiguous slice into its own bit vector
+        std::vector<BitVector> slice_data(n_thread);
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < n_thread; t++) {
+            int begin = (long long)block_num * t / n_thread;
+            int end = (long long)block_num * (t + 1) / n_thread;
+
+            threads.push_back(std::thread(
+                encode_block_range,
+                std::ref(blocks_data), begin, end,
+                get_statistics,
+                huffman_lum_ac,
+                huffman_lum_dc,
+                huffman_chrom_ac,
+                huffman_chrom_dc,
+                sample_blocks,
+                n_channel,
+                std::ref(slice_data[t])
+            ));
+        }
+
+        for (int t = 0; t < n_thread; t++) {
+            threads[t].join();
+            bit_data.add_bit_vector(slice_data[t]);
         }
     }
 
@@ -637,91 +1265,158 @@ void write_data_section(
     }
 }
 
-void write_EOI_section(std::ofstream &file) {
+void write_EOI_section(std::ostream &file) {
+    TRACE_ZONE("write_EOI_section");
+
     file.put(0xFF);
     file.put(0xD9);
 }
 
 void write_jpeg(
-    std::string &filename, int height, int width, std::vector<std::vector<iYCbCr>> &blocks_data,
+    std::ostream &file, int height, int width, std::vector<std::vector<iYCbCr>> &blocks_data,
     std::vector<int> &quan_lum,
     std::vector<int> &quan_chrom,
     std::vector<int> &huffman_lum_ac,
     std::vector<int> &huffman_lum_dc,
     std::vector<int> &huffman_chrom_ac,
-    std::vector<int> &huffman_chrom_dc
+    std::vector<int> &huffman_chrom_dc,
+    int n_channel,
+    int n_thread
 ) {
-    std::ofstream file(filename, std::ios::binary);
-
-    std::map<int, HuffmanInfo> huffman_info_lum_ac = preprocess_DHT(huffman_lum_ac);
-    std::map<int, HuffmanInfo> huffman_info_lum_dc = preprocess_DHT(huffman_lum_dc);
-    std::map<int, HuffmanInfo> huffman_info_chrom_ac = preprocess_DHT(huffman_chrom_ac);
-    std::map<int, HuffmanInfo> huffman_info_chrom_dc = preprocess_DHT(huffman_chrom_dc);
+    // standard tables come preprocessed, adjusted ones are preprocessed here
+    std::map<int, HuffmanInfo> adjusted_info[4];
+    std::map<int, HuffmanInfo> *huffman_info[4];
+    std::vector<int> *tables[4] = {&huffman_lum_ac, &huffman_lum_dc, &huffman_chrom_ac, &huffman_chrom_dc};
+
+    for (int i = 0; i < 4; i++) {
+        huffman_info[i] = get_standard_DHT_info(*tables[i]);
+        if (!huffman_info[i]) {
+            adjusted_info[i] = preprocess_DHT(*tables[i]);
+            huffman_info[i] = &adjusted_info[i];
+        }
+    }
 
     // SOI
     write_SOI_section(file);
 
     // DQT
     write_DQT_section(file, 0, quan_lum);
-    write_DQT_section(file, 1, quan_chrom);
+    if (n_channel == 3) {
+        write_DQT_section(file, 1, quan_chrom);
+    }
 
     // SOF0
-    write_SOF0_section(file, height, width);
+    write_SOF0_section(file, height, width, n_channel);
 
     // DHT AC, DC
     write_huffman_section(file, 0 + 0x10, huffman_lum_ac);
-    write_huffman_section(file, 1 + 0x10, huffman_chrom_ac);
+    if (n_channel == 3) {
+        write_huffman_section(file, 1 + 0x10, huffman_chrom_ac);
+    }
     write_huffman_section(file, 0 + 0x00, huffman_lum_dc);
-    write_huffman_section(file, 1 + 0x00, huffman_chrom_dc);
+    if (n_channel == 3) {
+        write_huffman_section(file, 1 + 0x00, huffman_chrom_dc);
+    }
 
     // SOS
-    write_SOS_section(file);
+    write_SOS_section(file, n_channel);
 
     // data
     write_data_section(
         file, blocks_data,
         0,
-        &huffman_info_lum_ac,
-        &huffman_info_lum_dc,
-        &huffman_info_chrom_ac,
-        &huffman_info_chrom_dc
+        huffman_info[0],
+        huffman_info[1],
+        huffman_info[2],
+        huffman_info[3],
+        nullptr,
+        n_channel,
+        n_thread > 0 ? n_thread : get_entropy_thread_num(blocks_data.size())
     );
 
     // EOI
     write_EOI_section(file);
+}
+
+void write_jpeg(
+    std::string &filename, int height, int width, std::vector<std::vector<iYCbCr>> &blocks_data,
+    std::vector<int> &quan_lum,
+    std::vector<int> &quan_chrom,
+    std::vector<int> &huffman_lum_ac,
+    std::vector<int> &huffman_lum_dc,
+    std::vector<int> &huffman_chrom_ac,
+    std::vector<int> &huffman_chrom_dc,
+    int n_channel,
+    int n_thread
+) {
+    std::ofstream file(filename, std::ios::binary);
+
+    write_jpeg(
+        file, height, width, blocks_data,
+        quan_lum,
+        quan_chrom,
+        huffman_lum_ac,
+        huffman_lum_dc,
+        huffman_chrom_ac,
+        huffman_chrom_dc,
+        n_channel,
+        n_thread
+    );
 
     file.flush();
     file.close();
 }
 
-// convert
-void convert_normal_jpeg(std::string &in_filename, std::string &out_filename) {
-    PPM image = load_PPM(in_filename);
+// encode
+bool encode_normal_jpeg(PPM &image, std::ostream &file) {
+    // nothing is written for an image that failed to load
+    if (!image.data) {
+        return false;
+    }
 
-    std::vector<std::vector<RGB>> RGB_data = PPM_data_to_vector(image);
-    std::vector<std::vector<dYCbCr>> YCbCr_data = RGB_to_YCbCr(RGB_data);
-    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data);
+    EncodeControl *control = get_encode_control();
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
 
-    image.width -= image.width % 8;
-    image.height -= image.height % 8;
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
 
     write_jpeg(
-        out_filename, image.height, image.width, blocks_data,
+        file, height, width, blocks_data,
         quan_lum,
         quan_chrom,
         huffman_lum_ac,
         huffman_lum_dc,
         huffman_chrom_ac,
-        huffman_chrom_dc
+        huffman_chrom_dc,
+        image.channel
     );
+
+    return true;
 }
 
-void convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filename) {
-    PPM image = load_PPM(in_filename);
+bool encode_adjusted_DHT_jpeg(PPM &image, std::ostream &file) {
+    if (!image.data) {
+        return false;
+    }
 
-    std::vector<std::vector<RGB>> RGB_data = PPM_data_to_vector(image);
-    std::vector<std::vector<dYCbCr>> YCbCr_data = RGB_to_YCbCr(RGB_data);
-    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data);
+    EncodeControl *control = get_encode_control();
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
 
     std::vector<int> lum_ac_cnt(0xFF + 1, 0);
     std::vector<int> lum_dc_cnt(0xFF + 1, 0);
@@ -735,7 +1430,9 @@ void convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filena
         &lum_ac_cnt, 
         &lum_dc_cnt,
         &chrom_ac_cnt,
-        &chrom_dc_cnt
+        &chrom_dc_cnt,
+        nullptr,
+        image.channel
     );
 
     // setup JPEG
@@ -744,41 +1441,291 @@ void convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filena
     std::vector<int> huffman_chrom_ac = huffman_encode(chrom_ac_cnt);
     std::vector<int> huffman_chrom_dc = huffman_encode(chrom_dc_cnt);
 
-    image.width -= image.width % 8;
-    image.height -= image.height % 8;
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
 
     write_jpeg(
-        out_filename, image.height, image.width, blocks_data,
+        file, height, width, blocks_data,
         quan_lum,
         quan_chrom,
         huffman_lum_ac,
         huffman_lum_dc,
         huffman_chrom_ac,
-        huffman_chrom_dc
+        huffman_chrom_dc,
+        image.channel
     );
+
+    return true;
 }
 
-void convert_adjusted_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale=1.0) {
-    PPM image = load_PPM(in_filename);
+bool encode_adjusted_DQT_jpeg(PPM &image, std::ostream &file, float scale) {
+    if (!image.data) {
+        return false;
+    }
 
-    std::vector<std::vector<RGB>> RGB_data = PPM_data_to_vector(image);
-    std::vector<std::vector<dYCbCr>> YCbCr_data = RGB_to_YCbCr(RGB_data);
-    std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> statistics_data = get_statistics_before_quantize(YCbCr_data);
+    EncodeControl *control = get_encode_control();
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+    std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> statistics_data = get_statistics_before_quantize(YCbCr_data, nullptr, image.channel);
     std::vector<int> quan_lum = get_adjusted_quantize_table(statistics_data.first, scale, 1);
-    std::vector<int> quan_chrom = get_adjusted_quantize_table(statistics_data.second, scale, 0);
+    std::vector<int> quan_chrom = image.channel == 1 ? ::quan_chrom : get_adjusted_quantize_table(statistics_data.second, scale, 0);
 
-    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom);
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
 
-    image.width -= image.width % 8;
-    image.height -= image.height % 8;
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
 
     write_jpeg(
-        out_filename, image.height, image.width, blocks_data,
+        file, height, width, blocks_data,
         quan_lum,
         quan_chrom,
         huffman_lum_ac,
         huffman_lum_dc,
         huffman_chrom_ac,
-        huffman_chrom_dc
+        huffman_chrom_dc,
+        image.channel
     );
+
+    return true;
+}
+
+bool encode_sampled_DHT_jpeg(PPM &image, std::ostream &file, SampleSetting &setting) {
+    if (!image.data) {
+        return false;
+    }
+
+    // an image without a whole block has nothing to sample, the standard tables are kept
+    std::vector<int> sample_blocks = get_sample_blocks(image.height / 8, image.width / 8, setting);
+    if (sample_blocks.empty()) {
+        return encode_normal_jpeg(image, file);
+    }
+
+    EncodeControl *control = get_encode_control();
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    std::vector<int> lum_ac_cnt(0xFF + 1, 0);
+    std::vector<int> lum_dc_cnt(0xFF + 1, 0);
+    std::vector<int> chrom_ac_cnt(0xFF + 1, 0);
+    std::vector<int> chrom_dc_cnt(0xFF + 1, 0);
+
+    std::ofstream useless_file;
+    write_data_section(
+        useless_file, blocks_data,
+        1,
+        &lum_ac_cnt,
+        &lum_dc_cnt,
+        &chrom_ac_cnt,
+        &chrom_dc_cnt,
+        &sample_blocks,
+        image.channel
+    );
+
+    add_fallback_frequency(lum_ac_cnt, 1);
+    add_fallback_frequency(lum_dc_cnt, 0);
+    add_fallback_frequency(chrom_ac_cnt, 1);
+    add_fallback_frequency(chrom_dc_cnt, 0);
+
+    // setup JPEG
+    std::vector<int> huffman_lum_ac = huffman_encode(lum_ac_cnt);
+    std::vector<int> huffman_lum_dc = huffman_encode(lum_dc_cnt);
+    std::vector<int> huffman_chrom_ac = huffman_encode(chrom_ac_cnt);
+    std::vector<int> huffman_chrom_dc = huffman_encode(chrom_dc_cnt);
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
+
+    write_jpeg(
+        file, height, width, blocks_data,
+        quan_lum,
+        quan_chrom,
+        huffman_lum_ac,
+        huffman_lum_dc,
+        huffman_chrom_ac,
+        huffman_chrom_dc,
+        image.channel
+    );
+
+    return true;
+}
+
+bool encode_sampled_DQT_jpeg(PPM &image, std::ostream &file, float scale, SampleSetting &setting) {
+    if (!image.data) {
+        return false;
+    }
+
+    // nothing to sample, as in encode_sampled_DHT_jpeg
+    std::vector<int> sample_blocks = get_sample_blocks(image.height / 8, image.width / 8, setting);
+    if (sample_blocks.empty()) {
+        return encode_normal_jpeg(image, file);
+    }
+
+    EncodeControl *control = get_encode_control();
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>> statistics_data = get_statistics_before_quantize(YCbCr_data, &sample_blocks, image.channel);
+    std::vector<int> quan_lum = get_adjusted_quantize_table(statistics_data.first, scale, 1);
+    std::vector<int> quan_chrom = image.channel == 1 ? ::quan_chrom : get_adjusted_quantize_table(statistics_data.second, scale, 0);
+
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
+
+    write_jpeg(
+        file, height, width, blocks_data,
+        quan_lum,
+        quan_chrom,
+        huffman_lum_ac,
+        huffman_lum_dc,
+        huffman_chrom_ac,
+        huffman_chrom_dc,
+        image.channel
+    );
+
+    return true;
+}
+
+bool encode_RDO_jpeg(PPM &image, std::ostream &file, double lambda, int fast) {
+    if (!image.data) {
+        return false;
+    }
+
+    EncodeControl *control = get_encode_control();
+    RDOSetting setting = {lambda, fast, get_standard_DHT_info(huffman_lum_ac), get_standard_DHT_info(huffman_chrom_ac)};
+
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, &setting, nullptr, control);
+    if (is_encode_cancelled(control)) {
+        return false;
+    }
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
+
+    write_jpeg(
+        file, height, width, blocks_data,
+        quan_lum,
+        quan_chrom,
+        huffman_lum_ac,
+        huffman_lum_dc,
+        huffman_chrom_ac,
+        huffman_chrom_dc,
+        image.channel
+    );
+
+    return true;
+}
+
+// convert
+bool convert_normal_jpeg(std::string &in_filename, std::string &out_filename) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_normal_jpeg(image, file);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
+}
+
+bool convert_adjusted_DHT_jpeg(std::string &in_filename, std::string &out_filename) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_adjusted_DHT_jpeg(image, file);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
+}
+
+bool convert_adjusted_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale=1.0) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_adjusted_DQT_jpeg(image, file, scale);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
+}
+
+bool convert_sampled_DHT_jpeg(std::string &in_filename, std::string &out_filename, SampleSetting &setting) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_sampled_DHT_jpeg(image, file, setting);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
+}
+
+bool convert_sampled_DQT_jpeg(std::string &in_filename, std::string &out_filename, float scale, SampleSetting &setting) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_sampled_DQT_jpeg(image, file, scale, setting);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
+}
+
+bool convert_RDO_jpeg(std::string &in_filename, std::string &out_filename, double lambda, int fast) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    bool done = encode_RDO_jpeg(image, file, lambda, fast);
+
+    file.close();
+    delete[] image.data;
+
+    return done && !file.fail();
 }
\ No newline at end of file
@@ -1,7 +1,20 @@
 #include <iostream>
 #include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
 
 #include "jpeg.hpp"
+#include "decoder.hpp"
+#include "benchmark.hpp"
+#include "pipeline.hpp"
+#include "daemon.hpp"
+#include "incremental.hpp"
+#include "sequence.hpp"
+#include "thumbnail.hpp"
+#include "async.hpp"
+#include "yuv.hpp"
+#include "trace.hpp"
 
 long long get_file_size(std::string filename) {
     std::ifstream file(filename, std::ifstream::binary);
@@ -15,7 +28,99 @@ long long get_file_size(std::string filename) {
     return len;
 }
 
-int main() {
+int run_bench(int argc, char **argv) {
+    // ./output.out bench [--psnr-offset dB] [--min-ssim value] [--max-ms-per-mp ms] [--out-folder path]
+    // outputs go to a scratch folder, never to the tracked sample/output_jpg
+    BenchmarkThreshold threshold = {0.0, 0.0, 0.0};
+    std::string out_folder = (std::filesystem::temp_directory_path() / "jpeg_bench").string() + "/";
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--psnr-offset") {
+            threshold.PSNR_offset = std::stod(argv[i + 1]);
+        } else if (option == "--min-ssim") {
+            threshold.min_SSIM = std::stod(argv[i + 1]);
+        } else if (option == "--max-ms-per-mp") {
+            threshold.max_ms_per_megapixel = std::stod(argv[i + 1]);
+        } else if (option == "--out-folder") {
+            out_folder = std::string(argv[i + 1]) + "/";
+        }
+    }
+
+    std::string in_folder = "sample/input_ppm/";
+    std::filesystem::create_directories(out_folder);
+
+    return run_benchmark(in_folder, out_folder, threshold) ? 1 : 0;
+}
+
+int run_daemon_mode(int argc, char **argv) {
+    // ./output.out daemon <socket_path> [n_worker] [--allow-shutdown]
+    if (argc < 3) {
+        std::cerr << "Usage: ./output.out daemon <socket_path> [n_worker] [--allow-shutdown]\n";
+        return 1;
+    }
+
+    std::string socket_path = argv[2];
+    DaemonSetting setting = {2, 16, 1LL << 28, false};
+    for (int i = 3; i < argc; i++) {
+        if (std::string(argv[i]) == "--allow-shutdown") {
+            setting.allow_shutdown = true;
+        } else {
+            setting.n_worker = std::stoi(argv[i]);
+        }
+    }
+
+    int served = run_daemon(socket_path, setting);
+    if (served < 0) {
+        return 1;
+    }
+    std::cout << "Daemon stopped after " << served << " connections.\n";
+    return 0;
+}
+
+int run_request(int argc, char **argv) {
+    // ./output.out request <socket_path> <mode> <scale> <in_filename> <out_filename>
+    if (argc < 7) {
+        std::cerr << "Usage: ./output.out request <socket_path> <mode> <scale> <in_filename> <out_filename>\n";
+        return 1;
+    }
+
+    std::string socket_path = argv[2];
+    std::ifstream in_file(argv[5], std::ios::binary);
+    std::vector<char> payload((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+    std::string line = std::string(argv[3]) + " " + argv[4] + " inline " + std::to_string(payload.size());
+    std::string reply;
+    std::vector<char> data;
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = send_daemon_request(socket_path, line, payload, reply, data);
+    auto end = std::chrono::steady_clock::now();
+
+    if (!ok) {
+        std::cerr << "Request failed: " << (reply.empty() ? "no reply" : reply) << "\n";
+        return 1;
+    }
+
+    std::ofstream out_file(argv[6], std::ios::binary);
+    out_file.write(data.data(), data.size());
+    out_file.close();
+
+    std::cout << "Encoded " << data.size() << " bytes in "
+        << std::fixed << std::setprecision(2) << std::chrono::duration<double, std::milli>(end - start).count() << " ms.\n";
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        return run_bench(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "daemon") {
+        return run_daemon_mode(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "request") {
+        return run_request(argc, argv);
+    }
+
     std::vector<std::string> filenames {
         "small",
         "red",
@@ -26,6 +131,13 @@ int main() {
         "origin_field"
     };
 
+    // every 8th MCU row plus 256 random blocks
+    SampleSetting sample_setting = {8, 256, 0};
+
+    // sample/output_jpg keeps the normal, DHT and DQT outputs, the rest go to a scratch folder
+    std::string demo_folder = (std::filesystem::temp_directory_path() / "jpeg_demo").string() + "/";
+    std::filesystem::create_directories(demo_folder);
+
     for (int i = 0; i < filenames.size(); i++) {
         std::string in_folder = "sample/input_ppm/";
         std::string out_folder = "sample/output_jpg/";
@@ -36,17 +148,31 @@ int main() {
         std::string out_file_normal = out_folder + filenames[i] + "_normal" + out_format;
         std::string out_file_DHT = out_folder + filenames[i] + "_DHT" + out_format;
         std::string out_file_DQT = out_folder + filenames[i] + "_DQT" + out_format;
+        std::string out_file_sampled_DHT = demo_folder + filenames[i] + "_sampled_DHT" + out_format;
+        std::string out_file_RDO = demo_folder + filenames[i] + "_RDO" + out_format;
+        std::string out_file_optimized = demo_folder + filenames[i] + "_optimized" + out_format;
+
+        if (!std::ifstream(in_file).good()) {
+            std::cout << "Skip " << filenames[i] << " case, " << in_file << " not found.\n\n";
+            continue;
+        }
 
         std::cout << "Process " << filenames[i] << " case.\n";
 
         convert_normal_jpeg(in_file, out_file_normal);
         convert_adjusted_DQT_jpeg(in_file, out_file_DQT, 1.0);
         convert_adjusted_DHT_jpeg(in_file, out_file_DHT);
+        convert_sampled_DHT_jpeg(in_file, out_file_sampled_DHT, sample_setting);
+        convert_RDO_jpeg(in_file, out_file_RDO, 120.0, 0);
+        convert_optimized_jpeg(out_file_normal, out_file_optimized);
 
         int in_size = get_file_size(in_file);
         int out_size_normal = get_file_size(out_file_normal);
         int out_size_DHT = get_file_size(out_file_DHT);
         int out_size_DQT = get_file_size(out_file_DQT);
+        int out_size_sampled_DHT = get_file_size(out_file_sampled_DHT);
+        int out_size_RDO = get_file_size(out_file_RDO);
+        int out_size_optimized = get_file_size(out_file_optimized);
 
         std::cout << "       input ppm size: " << std::setw(10) << in_size << " bytes.\n";
         std::cout << "      normal jpg size: " << std::setw(10) << out_size_normal << " bytes.";
@@ -55,9 +181,190 @@ int main() {
         std::cout << " (Rate: " << std::fixed << std::setprecision(2) << (100.0 * out_size_DQT / in_size)  << "%)\n";
         std::cout << "adjusted DHT jpg size: " << std::setw(10) << out_size_DHT << " bytes.";
         std::cout << " (Rate: " << std::fixed << std::setprecision(2) << (100.0 * out_size_DHT / in_size)  << "%)\n";
+        std::cout << " sampled DHT jpg size: " << std::setw(10) << out_size_sampled_DHT << " bytes.";
+        std::cout << " (Penalty: " << std::fixed << std::setprecision(2) << (100.0 * (out_size_sampled_DHT - out_size_DHT) / out_size_DHT)  << "%)\n";
+        std::cout << "         RDO jpg size: " << std::setw(10) << out_size_RDO << " bytes.";
+        std::cout << " (Rate: " << std::fixed << std::setprecision(2) << (100.0 * out_size_RDO / in_size)  << "%)\n";
+        std::cout << "   optimized jpg size: " << std::setw(10) << out_size_optimized << " bytes.";
+        std::cout << " (Rate: " << std::fixed << std::setprecision(2) << (100.0 * out_size_optimized / in_size)  << "%, losslessly from normal jpg)\n";
 
         std::cout << "\n";
     }
 
+    // batch convert with overlapped read, encode and write
+    std::vector<std::string> in_files, out_files;
+    for (int i = 0; i < filenames.size(); i++) {
+        in_files.push_back("sample/input_ppm/" + filenames[i] + ".ppm");
+        out_files.push_back(demo_folder + filenames[i] + "_batch.jpg");
+    }
+
+    PipelineSetting pipeline_setting = {1, 2, 2, 64LL << 20};
+    long long high_water = 0;
+    long long arena_high_water = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    int done_num = convert_batch_jpeg(in_files, out_files, encode_adjusted_DHT_jpeg, pipeline_setting, &high_water, &arena_high_water);
+    auto end = std::chrono::steady_clock::now();
+
+    std::cout << "Batch converted " << done_num << " files (adjusted DHT) in "
+        << std::fixed << std::setprecision(1) << std::chrono::duration<double, std::milli>(end - start).count() << " ms,"
+        << " in-flight memory high water " << high_water << " bytes";
+    if (arena_high_water) {
+        std::cout << ", encoder arena high water " << arena_high_water << " bytes";
+    }
+    std::cout << ".\n";
+
+    // every encode above, constant blocks skip the DCT, repeated blocks reuse coefficients
+    BlockCacheStats cache_stats = get_block_cache_stats();
+    std::cout << "Block cache hits " << cache_stats.uniform_num << " uniform and " << cache_stats.duplicate_num << " duplicate of "
+        << cache_stats.block_num << " blocks ("
+        << std::fixed << std::setprecision(1) << 100.0 * (cache_stats.uniform_num + cache_stats.duplicate_num) / std::max(1LL, cache_stats.block_num) << "%).\n";
+
+    // incremental re-encode after a small region changed
+    std::string in_file = "sample/input_ppm/test_1.ppm";
+    std::string out_file = demo_folder + "test_1_incremental.jpg";
+    if (std::ifstream(in_file).good()) {
+        PPM image = load_PPM(in_file);
+        IncrementalJPEG state;
+        init_incremental_jpeg(state, image);
+
+        for (int i = 16; i < 48 && i < image.height; i++) {
+            for (int j = 16; j < 48 && j < image.width; j++) {
+                image.data[(i * image.width + j) * image.channel] = 255;
+            }
+        }
+
+        start = std::chrono::steady_clock::now();
+        int encoded_num = update_incremental_jpeg(state, image);
+        end = std::chrono::steady_clock::now();
+
+        std::ofstream file(out_file, std::ios::binary);
+        write_incremental_jpeg(file, state);
+        file.close();
+        delete[] image.data;
+
+        std::cout << "Incremental update re-encoded " << encoded_num << " of " << state.segments.size() << " restart intervals in "
+            << std::fixed << std::setprecision(1) << std::chrono::duration<double, std::milli>(end - start).count() << " ms.\n";
+    }
+
+    // motion JPEG from a moving patch, tables refreshed once they save 2%
+    out_file = demo_folder + "test_1_sequence.avi";
+    if (std::ifstream(in_file).good()) {
+        PPM image = load_PPM(in_file);
+        std::ofstream file(out_file, std::ios::binary);
+        SequenceSetting setting = {SEQUENCE_AVI, 25, 0, 0.02, sample_setting};
+        SequenceEncoder encoder;
+        open_sequence(encoder, file, setting);
+
+        start = std::chrono::steady_clock::now();
+        for (int k = 0; k < 8; k++) {
+            for (int i = 0; i < 32 && i + 8 * k < image.height; i++) {
+                for (int j = 0; j < 32 && j + 16 * k < image.width; j++) {
+                    image.data[((i + 8 * k) * image.width + j + 16 * k) * image.channel] = 255;
+                }
+            }
+            add_sequence_frame(encoder, image);
+        }
+        end = std::chrono::steady_clock::now();
+
+        close_sequence(encoder);
+        file.close();
+        delete[] image.data;
+
+        std::cout << "Sequence encoded " << encoder.frame_num << " frames with " << encoder.refresh_num << " table refreshes in "
+            << std::fixed << std::setprecision(1) << std::chrono::duration<double, std::milli>(end - start).count() / encoder.frame_num << " ms per frame, "
+            << get_file_size(out_file) << " bytes.\n";
+    }
+
+    // 1/2, 1/4, 1/8 thumbnails from the coefficients of one transform pass
+    out_file = demo_folder + "test_1_thumbnail.jpg";
+    if (std::ifstream(in_file).good()) {
+        std::vector<int> scales = {2, 4, 8};
+        std::vector<std::string> thumbnail_files;
+        for (int scale: scales) {
+            thumbnail_files.push_back(demo_folder + "test_1_thumbnail_" + std::to_string(scale) + ".jpg");
+        }
+
+        convert_thumbnail_jpeg(in_file, out_file, scales, thumbnail_files);
+
+        std::cout << "Thumbnails written, sizes";
+        for (auto &thumbnail_file: thumbnail_files) {
+            std::cout << " " << get_file_size(thumbnail_file);
+        }
+        std::cout << " bytes.\n";
+    }
+
+    // async encode with per MCU row progress, then one cancelled after its first row
+    in_file = "sample/input_ppm/test_2.ppm";
+    out_file = demo_folder + "test_2_async.jpg";
+    if (std::ifstream(in_file).good()) {
+        EncodeControl control;
+        std::atomic<int> row_num(0);
+        control.progress = [&](int, int) { row_num++; };
+        bool done = convert_jpeg_async(in_file, out_file, encode_adjusted_DHT_jpeg, control).get();
+
+        EncodeControl cancel_control;
+        std::atomic<int> cancel_row_num(0);
+        cancel_control.progress = [&](int, int) {
+            if (++cancel_row_num == 1) {
+                cancel_control.cancelled = true;
+            }
+        };
+
+        start = std::chrono::steady_clock::now();
+        bool cancel_done = convert_jpeg_async(in_file, demo_folder + "test_2_cancelled.jpg", encode_adjusted_DHT_jpeg, cancel_control).get();
+        end = std::chrono::steady_clock::now();
+
+        std::cout << "Async encode " << (done ? "finished" : "failed") << " after " << row_num << " MCU rows, cancelled encode "
+            << (cancel_done ? "finished" : "stopped") << " after " << cancel_row_num << " of " << row_num << " in "
+            << std::fixed << std::setprecision(1) << std::chrono::duration<double, std::milli>(end - start).count() << " ms.\n";
+    }
+
+    // 4:2:0 straight from I420 planes, the planes are made from test_1 here
+    in_file = "sample/input_ppm/test_1.ppm";
+    out_file = demo_folder + "test_1_420.jpg";
+    if (std::ifstream(in_file).good()) {
+        PPM image = load_PPM(in_file);
+        std::vector<std::vector<RGB>> RGB_data = PPM_data_to_vector(image);
+        int chroma_width = (image.width + 1) / 2;
+        int chroma_height = (image.height + 1) / 2;
+        std::vector<unsigned char> data((long long)image.width * image.height + 2LL * chroma_width * chroma_height);
+        YUVImage yuv = {
+            YUV_I420, image.width, image.height,
+            {data.data(), data.data() + image.width * image.height, data.data() + image.width * image.height + chroma_width * chroma_height},
+            {image.width, chroma_width, chroma_width}
+        };
+
+        // chroma of the top-left pixel of every 2x2
+        for (int i = 0; i < image.height; i++) {
+            for (int j = 0; j < image.width; j++) {
+                dYCbCr pixel = pixel_to_YCbCr(RGB_data[i][j]);
+                yuv.planes[0][i * yuv.strides[0] + j] = std::max(0, std::min(255, around(pixel.y)));
+                if (i % 2 == 0 && j % 2 == 0) {
+                    yuv.planes[1][i / 2 * yuv.strides[1] + j / 2] = std::max(0, std::min(255, around(pixel.cb)));
+                    yuv.planes[2][i / 2 * yuv.strides[2] + j / 2] = std::max(0, std::min(255, around(pixel.cr)));
+                }
+            }
+        }
+        delete[] image.data;
+
+        start = std::chrono::steady_clock::now();
+        std::ofstream file(out_file, std::ios::binary);
+        encode_YUV_jpeg(yuv, file);
+        file.close();
+        end = std::chrono::steady_clock::now();
+
+        std::cout << "I420 encoded without color conversion in "
+            << std::fixed << std::setprecision(1) << std::chrono::duration<double, std::milli>(end - start).count() << " ms, "
+            << get_file_size(out_file) << " bytes.\n";
+    }
+
+    // only with make run TRACE=1
+    std::string trace_file = demo_folder + "trace.json";
+    if (dump_trace(trace_file)) {
+        std::cout << "Trace written to " << trace_file << ", open it in chrome://tracing or ui.perfetto.dev.\n";
+    }
+    std::cout << "Demo outputs other than normal, DHT and DQT are in " << demo_folder << ".\n";
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "pipeline.hpp"
+#include "arena.hpp"
+
+int convert_batch_jpeg(
+    std::vector<std::string> &in_filenames, std::vector<std::string> &out_filenames,
+    PipelineEncoder encode, PipelineSetting &setting, long long *high_water, long long *arena_high_water
+) {
+    BoundedQueue<PipelineJob> load_queue(setting.queue_depth);
+    BoundedQueue<PipelineJob> write_queue(setting.queue_depth);
+    MemoryBudget budget(setting.max_memory);
+
+    std::atomic<int> next_index(0);
+    std::atomic<int> done_num(0);
+
+    // the arenas hold at most the budget plus a partly used region per encoder, first batch decides
+    reserve_arena_space(setting.max_memory + setting.n_encoder * 2 * Arena::region_size);
+    std::mutex arena_mutex;
+    long long arena_peak = 0;
+
+    // read, prefetch the next inputs while the encoders are busy
+    std::vector<std::thread> readers;
+    for (int t = 0; t < setting.n_reader; t++) {
+        readers.push_back(std::thread([&] {
+            for (int i = next_index++; i < in_filenames.size(); i = next_index++) {
+                std::ifstream file(in_filenames[i], std::ios::binary | std::ios::ate);
+                if (!file.good()) {
+                    std::cerr << "Skip " << in_filenames[i] << ", not found.\n";
+                    continue;
+                }
+                long long file_size = file.tellg();
+                file.seekg(0);
+
+                PPM header;
+                if (!read_PPM_header(file, header, file_size)) {
+                    std::cerr << "Skip " << in_filenames[i] << ", malformed or truncated header.\n";
+                    continue;
+                }
+
+                // reserve before loading, the header gives the working set of the encode
+                long long memory = (long long)header.width * header.height * (header.channel + pipeline_bytes_per_pixel);
+                budget.acquire(memory);
+
+                file.seekg(0);
+                PipelineJob job = {i, load_PPM(file, file_size), "", memory};
+                if (!job.image.data) {
+                    std::cerr << "Skip " << in_filenames[i] << ", truncated.\n";
+                    budget.release(memory);
+                    continue;
+                }
+                load_queue.push(std::move(job));
+            }
+        }));
+    }
+
+    // encode into memory
+    std::vector<std::thread> encoders;
+    for (int t = 0; t < setting.n_encoder; t++) {
+        encoders.push_back(std::thread([&] {
+            // encoder temporaries come from a per-thread arena, dropped per image
+            Arena arena;
+            warm_encoder_tables();
+            set_entropy_thread_num(1);
+
+            PipelineJob job;
+            while (load_queue.pop(job)) {
+                std::ostringstream file(std::ios::binary);
+                bool done;
+                arena.reset();
+                {
+                    ArenaScope scope(arena);
+                    done = encode(job.image, file);
+                }
+                delete[] job.image.data;
+                job.image.data = nullptr;
+
+                if (!done) {
+                    std::cerr << "Skip " << in_filenames[job.index] << ", encode failed.\n";
+                    budget.release(job.memory);
+                    continue;
+                }
+
+                // swap the input bytes for the output bytes in the budget,
+                // without waiting since queued inputs may hold the rest
+                job.output = file.str();
+                budget.release(job.memory);
+                job.memory = job.output.size();
+                budget.acquire(job.memory, false);
+
+                write_queue.push(std::move(job));
+            }
+
+            std::unique_lock<std::mutex> lock(arena_mutex);
+            arena_peak = std::max(arena_peak, (long long)arena.get_high_water());
+        }));
+    }
+
+    // write, one large write per file
+    std::thread writer([&] {
+        PipelineJob job;
+        while (write_queue.pop(job)) {
+            std::ofstream file(out_filenames[job.index], std::ios::binary);
+            file.write(job.output.data(), job.output.size());
+            file.close();
+
+            budget.release(job.memory);
+            done_num++;
+        }
+    });
+
+    for (auto &t: readers) {
+        t.join();
+    }
+    load_queue.close();
+
+    for (auto &t: encoders) {
+        t.join();
+    }
+    write_queue.close();
+
+    writer.join();
+
+    if (high_water) {
+        *high_water = budget.get_high_water();
+    }
+    if (arena_high_water) {
+        *arena_high_water = arena_peak;
+    }
+
+    return done_num;
+}
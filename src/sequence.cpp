@@ -0,0 +1,313 @@
+#include <sstream>
+#include <algorithm>
+
+#include "huffman.hpp"
+#include "sequence.hpp"
+
+// tables
+long long get_histogram_bits(std::vector<int> &histogram, const std::map<int, HuffmanInfo> &info, int is_ac) {
+    // huffman code plus the appended value bits
+    long long bits = 0;
+    for (int symbol = 0; symbol < histogram.size(); symbol++) {
+        if (histogram[symbol] == 0) {
+            continue;
+        }
+        int extra = is_ac ? (symbol & 0x0F) : symbol;
+        bits += (long long)histogram[symbol] * (get_huffman_info(info, symbol).n_bits + extra);
+    }
+    return bits;
+}
+
+void set_sequence_tables(SequenceEncoder &encoder, std::vector<int> *huffman_tables) {
+    for (int k = 0; k < 4; k++) {
+        encoder.huffman_tables[k] = huffman_tables[k];
+        encoder.huffman_info[k] = preprocess_DHT(huffman_tables[k]);
+    }
+
+    // the header of every frame is cached until the next refresh
+    std::ostringstream file(std::ios::binary);
+    write_SOI_section(file);
+    write_DQT_section(file, 0, quan_lum);
+    if (encoder.n_channel == 3) {
+        write_DQT_section(file, 1, quan_chrom);
+    }
+    write_SOF0_section(file, encoder.height, encoder.width, encoder.n_channel);
+    write_huffman_section(file, 0 + 0x10, huffman_tables[0]);
+    if (encoder.n_channel == 3) {
+        write_huffman_section(file, 1 + 0x10, huffman_tables[2]);
+    }
+    write_huffman_section(file, 0 + 0x00, huffman_tables[1]);
+    if (encoder.n_channel == 3) {
+        write_huffman_section(file, 1 + 0x00, huffman_tables[3]);
+    }
+    write_SOS_section(file, encoder.n_channel);
+
+    std::string header = file.str();
+    encoder.header.assign(header.begin(), header.end());
+}
+
+double get_sequence_gain(SequenceEncoder &encoder, std::vector<int> *huffman_tables) {
+    // estimated fraction of the data saved by tables built from the running histograms
+    long long current_bits = 0;
+    long long new_bits = 0;
+
+    for (int k = 0; k < 4; k++) {
+        std::vector<int> freq = encoder.histograms[k];
+        add_fallback_frequency(freq, k % 2 == 0);
+        huffman_tables[k] = huffman_encode(freq);
+
+        std::map<int, HuffmanInfo> info = preprocess_DHT(huffman_tables[k]);
+        current_bits += get_histogram_bits(encoder.histograms[k], encoder.huffman_info[k], k % 2 == 0);
+        new_bits += get_histogram_bits(encoder.histograms[k], info, k % 2 == 0);
+    }
+
+    return current_bits ? 1.0 - (double)new_bits / current_bits : 0.0;
+}
+
+// AVI
+void write_le16(std::ostream &file, int value) {
+    file.put(value >> 0);
+    file.put(value >> 8);
+}
+
+void write_le32(std::ostream &file, long long value) {
+    file.put(value >> 0);
+    file.put(value >> 8);
+    file.put(value >> 16);
+    file.put(value >> 24);
+}
+
+void write_fourcc(std::ostream &file, const char *fourcc) {
+    file.write(fourcc, 4);
+}
+
+void write_AVI_header(SequenceEncoder &encoder) {
+    std::ostream &file = *encoder.file;
+    int width = encoder.width;
+    int height = encoder.height;
+    int fps = encoder.setting.fps;
+
+    // sizes, frame counts are patched by close_sequence
+    encoder.riff_pos = file.tellp();
+    write_fourcc(file, "RIFF");
+    write_le32(file, 0);
+    write_fourcc(file, "AVI ");
+
+    write_fourcc(file, "LIST");
+    write_le32(file, 192);
+    write_fourcc(file, "hdrl");
+
+    // avih
+    write_fourcc(file, "avih");
+    write_le32(file, 56);
+    write_le32(file, 1000000 / fps);    // us per frame
+    write_le32(file, 0);                // max bytes per second
+    write_le32(file, 0);                // padding granularity
+    write_le32(file, 0x10);             // has index
+    write_le32(file, 0);                // total frames
+    write_le32(file, 0);                // initial frames
+    write_le32(file, 1);                // streams
+    write_le32(file, 0);                // suggested buffer size
+    write_le32(file, width);
+    write_le32(file, height);
+    for (int i = 0; i < 4; i++) {
+        write_le32(file, 0);
+    }
+
+    write_fourcc(file, "LIST");
+    write_le32(file, 116);
+    write_fourcc(file, "strl");
+
+    // strh
+    write_fourcc(file, "strh");
+    write_le32(file, 56);
+    write_fourcc(file, "vids");
+    write_fourcc(file, "MJPG");
+    write_le32(file, 0);                // flags
+    write_le16(file, 0);                // priority
+    write_le16(file, 0);                // language
+    write_le32(file, 0);                // initial frames
+    write_le32(file, 1);                // scale
+    write_le32(file, fps);              // rate
+    write_le32(file, 0);                // start
+    write_le32(file, 0);                // length
+    write_le32(file, 0);                // suggested buffer size
+    write_le32(file, -1);               // quality
+    write_le32(file, 0);                // sample size
+    write_le16(file, 0);
+    write_le16(file, 0);
+    write_le16(file, width);
+    write_le16(file, height);
+
+    // strf, BITMAPINFOHEADER
+    write_fourcc(file, "strf");
+    write_le32(file, 40);
+    write_le32(file, 40);
+    write_le32(file, width);
+    write_le32(file, height);
+    write_le16(file, 1);
+    write_le16(file, 24);
+    write_fourcc(file, "MJPG");
+    write_le32(file, width * height * 3);
+    for (int i = 0; i < 4; i++) {
+        write_le32(file, 0);
+    }
+
+    write_fourcc(file, "LIST");
+    write_le32(file, 0);
+    encoder.movi_pos = file.tellp();
+    write_fourcc(file, "movi");
+}
+
+// sequence
+void open_sequence(SequenceEncoder &encoder, std::ostream &file, SequenceSetting &setting) {
+    encoder.file = &file;
+    encoder.setting = setting;
+    encoder.height = 0;
+    encoder.width = 0;
+    encoder.n_channel = 0;
+    encoder.frame_num = 0;
+    encoder.refresh_num = 0;
+    encoder.frames_since_refresh = 0;
+    encoder.index.clear();
+}
+
+bool add_sequence_frame(SequenceEncoder &encoder, PPM &image) {
+    if (!image.data) {
+        return false;
+    }
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
+
+    // the first frame fixes the geometry, starting from the standard tables
+    if (encoder.frame_num == 0) {
+        encoder.height = height;
+        encoder.width = width;
+        encoder.n_channel = image.channel;
+        encoder.sample_blocks = get_sample_blocks(height / 8, width / 8, encoder.setting.sample);
+        for (int k = 0; k < 4; k++) {
+            encoder.histograms[k].assign(0xFF + 1, 0);
+        }
+
+        std::vector<int> standard_tables[4] = {huffman_lum_ac, huffman_lum_dc, huffman_chrom_ac, huffman_chrom_dc};
+        set_sequence_tables(encoder, standard_tables);
+
+        if (encoder.setting.format == SEQUENCE_AVI) {
+            write_AVI_header(encoder);
+        }
+    } else if (height != encoder.height || width != encoder.width || image.channel != encoder.n_channel) {
+        return false;
+    }
+
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel);
+
+    // running histograms, only over the sampled blocks
+    std::ofstream useless_file;
+    write_data_section(
+        useless_file, blocks_data,
+        1,
+        &encoder.histograms[0],
+        &encoder.histograms[1],
+        &encoder.histograms[2],
+        &encoder.histograms[3],
+        &encoder.sample_blocks,
+        image.channel
+    );
+    encoder.frames_since_refresh++;
+
+    // refresh every N frames or once it pays off
+    std::vector<int> new_tables[4];
+    double gain = get_sequence_gain(encoder, new_tables);
+    SequenceSetting &setting = encoder.setting;
+
+    // frames without a whole block sample nothing and keep the standard tables
+    if (!encoder.sample_blocks.empty()
+        && ((setting.refresh_interval > 0 && encoder.frames_since_refresh >= setting.refresh_interval)
+        || (setting.refresh_gain > 0 && gain >= setting.refresh_gain))) {
+        set_sequence_tables(encoder, new_tables);
+        for (int k = 0; k < 4; k++) {
+            encoder.histograms[k].assign(0xFF + 1, 0);
+        }
+        encoder.frames_since_refresh = 0;
+        encoder.refresh_num++;
+    }
+
+    // frame
+    std::ostringstream frame(std::ios::binary);
+    frame.write((char *)encoder.header.data(), encoder.header.size());
+    write_data_section(
+        frame, blocks_data,
+        0,
+        &encoder.huffman_info[0],
+        &encoder.huffman_info[1],
+        &encoder.huffman_info[2],
+        &encoder.huffman_info[3],
+        nullptr,
+        image.channel,
+        get_entropy_thread_num(blocks_data.size())
+    );
+    write_EOI_section(frame);
+    std::string data = frame.str();
+
+    std::ostream &file = *encoder.file;
+    if (setting.format == SEQUENCE_AVI) {
+        encoder.index.push_back({(long long)file.tellp() - encoder.movi_pos, data.size()});
+        write_fourcc(file, "00dc");
+        write_le32(file, data.size());
+        file.write(data.data(), data.size());
+        if (data.size() % 2) {
+            file.put(0x00);
+        }
+    } else {
+        file << "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " << data.size() << "\r\n\r\n";
+        file.write(data.data(), data.size());
+        file << "\r\n";
+    }
+
+    encoder.frame_num++;
+    return true;
+}
+
+void close_sequence(SequenceEncoder &encoder) {
+    std::ostream &file = *encoder.file;
+
+    if (encoder.setting.format == SEQUENCE_MULTIPART) {
+        file << "--frame--\r\n";
+        return;
+    }
+    if (encoder.frame_num == 0) {
+        return;
+    }
+
+    long long movi_end = file.tellp();
+    long long max_size = 0;
+
+    // idx1, offsets relative to the movi fourcc
+    write_fourcc(file, "idx1");
+    write_le32(file, 16 * encoder.index.size());
+    for (auto &entry: encoder.index) {
+        write_fourcc(file, "00dc");
+        write_le32(file, 0x10);     // key frame
+        write_le32(file, entry.first);
+        write_le32(file, entry.second);
+        max_size = std::max(max_size, entry.second);
+    }
+    long long riff_end = file.tellp();
+
+    // patch sizes and counts left open by write_AVI_header
+    file.seekp(encoder.riff_pos + 4);
+    write_le32(file, riff_end - encoder.riff_pos - 8);
+    file.seekp(encoder.riff_pos + 48);
+    write_le32(file, encoder.frame_num);
+    file.seekp(encoder.riff_pos + 60);
+    write_le32(file, max_size + 8);
+    file.seekp(encoder.riff_pos + 140);
+    write_le32(file, encoder.frame_num);
+    write_le32(file, max_size + 8);
+    file.seekp(encoder.movi_pos - 4);
+    write_le32(file, movi_end - encoder.movi_pos);
+
+    file.seekp(riff_end);
+}
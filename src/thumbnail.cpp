@@ -0,0 +1,138 @@
+#include <cmath>
+
+#include "thumbnail.hpp"
+
+std::vector<std::vector<double>> get_reduced_IDCT_table(int size) {
+    // size x size IDCT basis, scaled by sqrt(size / 8) per axis to keep the 8x8 gain
+    std::vector<std::vector<double>> table(size, std::vector<double>(size, 0.0));
+
+    for (int x = 0; x < size; x++) {
+        for (int u = 0; u < size; u++) {
+            double alpha = u == 0 ? std::sqrt(1.0 / size) : std::sqrt(2.0 / size);
+            table[x][u] = std::sqrt(size / 8.0) * alpha * std::cos((2.0 * x + 1.0) * u * M_PI / (2.0 * size));
+        }
+    }
+
+    return table;
+}
+
+std::vector<std::vector<dYCbCr>> get_DCT_thumbnail(std::vector<std::vector<iYCbCr>> &DCT_blocks, int block_rows, int block_cols, int scale) {
+    const int block = 8;
+
+    int size = block / scale;
+    std::vector<std::vector<double>> table = get_reduced_IDCT_table(size);
+    std::vector<std::vector<dYCbCr>> YCbCr_data(std::vector(block_rows * size, std::vector(block_cols * size, dYCbCr {0.0, 0.0, 0.0})));
+    std::vector<dYCbCr> tmp(size * size);
+
+    for (int i = 0; i < block_rows * block_cols; i++) {
+        std::vector<iYCbCr> &DCT_data = DCT_blocks[i];
+        int row = i / block_cols * size;
+        int col = i % block_cols * size;
+
+        // rows, coefficients are stored as vertical * block + horizontal frequency
+        for (int u = 0; u < size; u++) {
+            for (int y = 0; y < size; y++) {
+                dYCbCr sum = {0.0, 0.0, 0.0};
+                for (int v = 0; v < size; v++) {
+                    sum.y += table[y][v] * DCT_data[u * block + v].y;
+                    sum.cb += table[y][v] * DCT_data[u * block + v].cb;
+                    sum.cr += table[y][v] * DCT_data[u * block + v].cr;
+                }
+                tmp[u * size + y] = sum;
+            }
+        }
+
+        // columns, then undo the level shift
+        for (int x = 0; x < size; x++) {
+            for (int y = 0; y < size; y++) {
+                dYCbCr sum = {128.0, 128.0, 128.0};
+                for (int u = 0; u < size; u++) {
+                    sum.y += table[x][u] * tmp[u * size + y].y;
+                    sum.cb += table[x][u] * tmp[u * size + y].cb;
+                    sum.cr += table[x][u] * tmp[u * size + y].cr;
+                }
+                YCbCr_data[row + x][col + y] = sum;
+            }
+        }
+    }
+
+    return YCbCr_data;
+}
+
+bool encode_thumbnail_jpeg(PPM &image, std::ostream &file, std::vector<int> &scales, std::vector<std::ostream *> &thumbnail_files) {
+    if (!image.data) {
+        return false;
+    }
+
+    std::vector<std::vector<dYCbCr>> YCbCr_data = image_to_YCbCr(image);
+    std::vector<std::vector<iYCbCr>> DCT_blocks;
+    std::vector<std::vector<iYCbCr>> blocks_data = do_partition_process(YCbCr_data, quan_lum, quan_chrom, image.channel, nullptr, &DCT_blocks);
+
+    int height = image.height - image.height % 8;
+    int width = image.width - image.width % 8;
+
+    write_jpeg(
+        file, height, width, blocks_data,
+        quan_lum,
+        quan_chrom,
+        huffman_lum_ac,
+        huffman_lum_dc,
+        huffman_chrom_ac,
+        huffman_chrom_dc,
+        image.channel
+    );
+
+    // thumbnails from the coefficients of the pass above
+    for (int k = 0; k < scales.size(); k++) {
+        if (scales[k] != 2 && scales[k] != 4 && scales[k] != 8) {
+            continue;
+        }
+
+        std::vector<std::vector<dYCbCr>> thumbnail_data = get_DCT_thumbnail(DCT_blocks, height / 8, width / 8, scales[k]);
+        if (thumbnail_data.size() < 8 || thumbnail_data[0].size() < 8) {
+            continue;
+        }
+
+        std::vector<std::vector<iYCbCr>> thumbnail_blocks = do_partition_process(thumbnail_data, quan_lum, quan_chrom, image.channel);
+        int thumbnail_height = thumbnail_data.size() - thumbnail_data.size() % 8;
+        int thumbnail_width = thumbnail_data[0].size() - thumbnail_data[0].size() % 8;
+
+        write_jpeg(
+            *thumbnail_files[k], thumbnail_height, thumbnail_width, thumbnail_blocks,
+            quan_lum,
+            quan_chrom,
+            huffman_lum_ac,
+            huffman_lum_dc,
+            huffman_chrom_ac,
+            huffman_chrom_dc,
+            image.channel
+        );
+    }
+
+    return true;
+}
+
+bool convert_thumbnail_jpeg(std::string &in_filename, std::string &out_filename, std::vector<int> &scales, std::vector<std::string> &thumbnail_filenames) {
+    PPM image = load_PPM(in_filename);
+    if (!image.data) {
+        return false;
+    }
+    std::ofstream file(out_filename, std::ios::binary);
+
+    std::vector<std::ofstream> thumbnail_files(thumbnail_filenames.size());
+    std::vector<std::ostream *> thumbnail_streams;
+    for (int k = 0; k < thumbnail_filenames.size(); k++) {
+        thumbnail_files[k].open(thumbnail_filenames[k], std::ios::binary);
+        thumbnail_streams.push_back(&thumbnail_files[k]);
+    }
+
+    bool done = encode_thumbnail_jpeg(image, file, scales, thumbnail_streams);
+
+    for (auto &thumbnail_file: thumbnail_files) {
+        thumbnail_file.close();
+    }
+    file.close();
+    delete[] image.data;
+
+    return done;
+}
@@ -0,0 +1,110 @@
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+#include "trace.hpp"
+
+#ifdef JPEG_TRACE
+
+// buffers outlive their threads so a dump still sees finished workers,
+// the buffers of exited threads are reused instead of growing per spawned thread
+std::mutex trace_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+std::vector<TraceBuffer *> free_trace_buffers;
+
+struct TraceBufferHolder {
+    TraceBuffer *buffer = nullptr;
+
+    ~TraceBufferHolder() {
+        if (buffer) {
+            std::unique_lock<std::mutex> lock(trace_mutex);
+            free_trace_buffers.push_back(buffer);
+        }
+    }
+};
+
+long long get_trace_time() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+TraceBuffer &get_trace_buffer() {
+    // taken once per thread, recording itself takes no lock
+    thread_local TraceBufferHolder holder;
+    if (!holder.buffer) {
+        std::unique_lock<std::mutex> lock(trace_mutex);
+        if (!free_trace_buffers.empty()) {
+            holder.buffer = free_trace_buffers.back();
+            free_trace_buffers.pop_back();
+        } else {
+            trace_buffers.push_back(std::make_unique<TraceBuffer>());
+            holder.buffer = trace_buffers.back().get();
+            holder.buffer->thread_id = trace_buffers.size();
+        }
+    }
+    return *holder.buffer;
+}
+
+void record_trace_event(const char *name, long long begin, long long end, int arg) {
+    TraceBuffer &buffer = get_trace_buffer();
+    long long count = buffer.count.load(std::memory_order_relaxed);
+
+    // claimed moves before the slot is rewritten, so a dump copying it can tell
+    buffer.claimed.store(count + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    buffer.events[count % TraceBuffer::capacity] = TraceEvent {name, begin, end, arg};
+    buffer.count.store(count + 1, std::memory_order_release);
+}
+
+bool dump_trace(std::string &filename) {
+    std::ofstream file(filename);
+    std::unique_lock<std::mutex> lock(trace_mutex);
+
+    file << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+
+    bool first = true;
+    std::vector<TraceEvent> events;
+    for (auto &buffer: trace_buffers) {
+        // copy the committed events, then drop those whose slot was claimed again meanwhile
+        long long count = buffer->count.load(std::memory_order_acquire);
+        long long begin = std::max(0LL, count - TraceBuffer::capacity);
+
+        events.clear();
+        for (long long k = begin; k < count; k++) {
+            events.push_back(buffer->events[k % TraceBuffer::capacity]);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        long long valid = std::max(begin, buffer->claimed.load(std::memory_order_relaxed) - TraceBuffer::capacity);
+
+        for (long long k = valid; k < count; k++) {
+            TraceEvent &event = events[k - begin];
+
+            // complete events, timestamps in us
+            file << (first ? "" : ",\n")
+                << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id
+                << ",\"ts\":" << event.begin / 1000.0 << ",\"dur\":" << (event.end - event.begin) / 1000.0;
+            if (event.arg >= 0) {
+                file << ",\"args\":{\"index\":" << event.arg << "}";
+            }
+            file << "}";
+            first = false;
+        }
+    }
+
+    file << "\n]}\n";
+    file.close();
+
+    return !file.fail();
+}
+
+#else
+
+bool dump_trace(std::string &) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include <cmath>
+#include <algorithm>
+
+#include "yuv.hpp"
+#include "trace.hpp"
+
+std::vector<YUVPlane> get_YUV_planes(YUVImage &image) {
+    int chroma_width = (image.width + 1) / 2;
+    int chroma_height = (image.height + 1) / 2;
+
+    if (image.format == YUV_I420) {
+        return {
+            {image.planes[0], image.strides[0], 1, image.width, image.height},
+            {image.planes[1], image.strides[1], 1, chroma_width, chroma_height},
+            {image.planes[2], image.strides[2], 1, chroma_width, chroma_height}
+        };
+    } else if (image.format == YUV_NV12) {
+        return {
+            {image.planes[0], image.strides[0], 1, image.width, image.height},
+            {image.planes[1], image.strides[1], 2, chroma_width, chroma_height},
+            {image.planes[1] + 1, image.strides[1], 2, chroma_width, chroma_height}
+        };
+    }
+    return {
+        {image.planes[0], image.strides[0], 2, image.width, image.height},
+        {image.planes[0] + 1, image.strides[0], 4, chroma_width, image.height},
+        {image.planes[0] + 3, image.strides[0], 4, chroma_width, image.height}
+    };
+}
+
+void init_YUV_JPEG(JPEG &jpeg, YUVImage &image) {
+    // Y is 2x2 (4:2:0) or 2x1 (4:2:2) blocks per MCU, Cb and Cr one block each
+    int v = image.format == YUV_YUYV ? 1 : 2;
+
+    jpeg.max_h = 2;
+    jpeg.max_v = v;
+    jpeg.mcu_rows = (image.height + 8 * v - 1) / (8 * v);
+    jpeg.mcu_cols = (image.width + 15) / 16;
+    jpeg.height = image.height;
+    jpeg.width = image.width;
+    jpeg.restart_interval = 0;
+
+    jpeg.quan_tables = {quan_lum, quan_chrom, std::vector<int>(0), std::vector<int>(0)};
+    jpeg.huffman_dc = {huffman_lum_dc, huffman_chrom_dc, std::vector<int>(0), std::vector<int>(0)};
+    jpeg.huffman_ac = {huffman_lum_ac, huffman_chrom_ac, std::vector<int>(0), std::vector<int>(0)};
+    jpeg.app_segments.clear();
+
+    jpeg.components = {
+        {1, 2, v, 0, 0, 0, jpeg.mcu_rows * v, jpeg.mcu_cols * 2, {}},
+        {2, 1, 1, 1, 1, 1, jpeg.mcu_rows, jpeg.mcu_cols, {}},
+        {3, 1, 1, 1, 1, 1, jpeg.mcu_rows, jpeg.mcu_cols, {}}
+    };
+}
+
+void do_plane_DCT(YUVPlane &plane, int row, int col, std::vector<double> &cos_table, std::vector<int> &block_data) {
+    // separable, same level shift and scaling as do_2d_DCT, natural order out
+    const int block = 8;
+    double tmp[block * block];
+
+    // byte offsets of the columns, clamped to the last sample in the padding
+    long long offset[block];
+    for (int n = 0; n < block; n++) {
+        offset[n] = (long long)std::min(col + n, plane.width - 1) * plane.step;
+    }
+
+    for (int m = 0; m < block; m++) {
+        unsigned char *line = plane.data + (long long)std::min(row + m, plane.height - 1) * plane.stride;
+        for (int l = 0; l < block; l++) {
+            double sum = 0.0;
+            for (int n = 0; n < block; n++) {
+                sum += (line[offset[n]] - 128.0) * cos_table[l * block + n];
+            }
+            tmp[m * block + l] = sum;
+        }
+    }
+
+    for (int k = 0; k < block; k++) {
+        for (int l = 0; l < block; l++) {
+            double sum = 0.0;
+            for (int m = 0; m < block; m++) {
+                sum += tmp[m * block + l] * cos_table[k * block + m];
+            }
+            block_data[k * block + l] = around(sum);
+        }
+    }
+}
+
+bool encode_YUV_jpeg(YUVImage &image, std::ostream &file, int adjusted_DHT) {
+    TRACE_ZONE("encode_YUV_jpeg");
+
+    const int block = 8;
+
+    JPEG jpeg;
+    init_YUV_JPEG(jpeg, image);
+    if (image.width <= 0 || image.height <= 0) {
+        return false;
+    }
+
+    // alpha(u) * cos((2x + 1) u pi / 16)
+    std::vector<double> cos_table(block * block);
+    for (int u = 0; u < block; u++) {
+        double alpha = u == 0 ? std::sqrt(1.0 / block) : std::sqrt(2.0 / block);
+        for (int x = 0; x < block; x++) {
+            cos_table[u * block + x] = alpha * std::cos((2.0 * x + 1.0) * u * M_PI / (2.0 * block));
+        }
+    }
+
+    std::vector<std::vector<int>> order = get_zigzag_order(block);
+    std::vector<YUVPlane> planes = get_YUV_planes(image);
+    std::vector<int> block_data(block * block);
+    EncodeControl *control = get_encode_control();
+
+    for (int c = 0; c < jpeg.components.size(); c++) {
+        JPEGComponent &comp = jpeg.components[c];
+        std::vector<int> &quan_table = jpeg.quan_tables[comp.quan_id];
+        comp.blocks.assign(comp.block_rows * comp.block_cols, std::vector<int>(block * block, 0));
+
+        for (int i = 0; i < comp.block_rows; i++) {
+            // a cancelled encode writes nothing
+            if (is_encode_cancelled(control)) {
+                return false;
+            }
+
+            for (int j = 0; j < comp.block_cols; j++) {
+                do_plane_DCT(planes[c], i * block, j * block, cos_table, block_data);
+
+                // quantize, zig zag
+                std::vector<int> &out = comp.blocks[i * comp.block_cols + j];
+                for (int k = 0; k < order.size(); k++) {
+                    int index = order[k][0] * block + order[k][1];
+                    out[k] = block_data[index] / quan_table[index];
+                }
+            }
+
+            if (control && control->progress && c == 0) {
+                control->progress((i + 1) / comp.v, jpeg.mcu_rows);
+            }
+        }
+    }
+
+    if (adjusted_DHT) {
+        optimize_JPEG_huffman(jpeg);
+    }
+    write_JPEG(file, jpeg);
+
+    return true;
+}
+
+bool load_YUV(std::string &filename, int format, int width, int height, YUVImage &image, std::vector<unsigned char> &data) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.good() || width <= 0 || height <= 0) {
+        return false;
+    }
+
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    long long size;
+
+    image = {format, width, height, {nullptr, nullptr, nullptr}, {0, 0, 0}};
+    if (format == YUV_I420 || format == YUV_NV12) {
+        size = (long long)width * height + 2LL * chroma_width * chroma_height;
+    } else if (format == YUV_YUYV) {
+        size = 4LL * chroma_width * height;
+    } else {
+        return false;
+    }
+
+    data.resize(size);
+    file.read((char *)data.data(), size);
+    if (file.gcount() != size) {
+        return false;
+    }
+
+    if (format == YUV_I420) {
+        image.planes[0] = data.data();
+        image.planes[1] = image.planes[0] + (long long)width * height;
+        image.planes[2] = image.planes[1] + (long long)chroma_width * chroma_height;
+        image.strides[0] = width;
+        image.strides[1] = chroma_width;
+        image.strides[2] = chroma_width;
+    } else if (format == YUV_NV12) {
+        image.planes[0] = data.data();
+        image.planes[1] = image.planes[0] + (long long)width * height;
+        image.strides[0] = width;
+        image.strides[1] = 2 * chroma_width;
+    } else {
+        image.planes[0] = data.data();
+        image.strides[0] = 4 * chroma_width;
+    }
+
+    return true;
+}
+
+bool convert_YUV_jpeg(std::string &in_filename, std::string &out_filename, int format, int width, int height, int adjusted_DHT) {
+    YUVImage image;
+    std::vector<unsigned char> data;
+    if (!load_YUV(in_filename, format, width, height, image, data)) {
+        return false;
+    }
+
+    std::ofstream file(out_filename, std::ios::binary);
+    bool done = encode_YUV_jpeg(image, file, adjusted_DHT);
+    file.close();
+
+    return done;
+}